@@ -0,0 +1,113 @@
+// BoundedQueue.hpp
+
+#ifndef _BOUNDED_QUEUE_HPP
+#define _BOUNDED_QUEUE_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/atomic.hpp>
+
+// Bounded multi-producer multi-consumer queue (after Dmitry Vyukov's array queue).
+// Each cell carries a sequence number telling producers and consumers whose turn it is,
+// so push and pop are a single compare-and-swap on the enqueue or dequeue position.
+// The capacity is fixed (rounded up to a power of 2) and nothing is allocated after construction.
+// push() returns false when the queue is full, pop() returns false when it is empty.
+
+template< typename T >
+class BoundedQueue {
+public:
+	const static size_t CacheLineSize = 64;
+
+	BoundedQueue(size_t capacity) : _cells(roundUp(capacity)), _mask(_cells.size() - 1), _enqueuePos(0), _dequeuePos(0) {
+		for (size_t i = 0; i < _cells.size(); i++)
+			_cells[i]._seq.store(i, boost::memory_order_relaxed);
+	}
+
+	bool push(const T &value) {
+		Cell *cell;
+		size_t pos = _enqueuePos.load(boost::memory_order_relaxed);
+		while (true) {
+			cell = &_cells[pos & _mask];
+			size_t seq = cell->_seq.load(boost::memory_order_acquire);
+			intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+			if (dif == 0) {
+				if (_enqueuePos.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false; // full: the cell still holds the value from one lap ago
+			} else {
+				pos = _enqueuePos.load(boost::memory_order_relaxed);
+			}
+		}
+		cell->_value = value;
+		cell->_seq.store(pos + 1, boost::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &value) {
+		Cell *cell;
+		size_t pos = _dequeuePos.load(boost::memory_order_relaxed);
+		while (true) {
+			cell = &_cells[pos & _mask];
+			size_t seq = cell->_seq.load(boost::memory_order_acquire);
+			intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+			if (dif == 0) {
+				if (_dequeuePos.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false; // empty: the cell has not been written this lap
+			} else {
+				pos = _dequeuePos.load(boost::memory_order_relaxed);
+			}
+		}
+		value = cell->_value;
+		cell->_seq.store(pos + _mask + 1, boost::memory_order_release);
+		return true;
+	}
+
+	// approximate while other threads push or pop
+	bool empty() const {
+		size_t pos = _dequeuePos.load(boost::memory_order_relaxed);
+		return _cells[pos & _mask]._seq.load(boost::memory_order_acquire) != pos + 1;
+	}
+	size_t size() const {
+		size_t head = _dequeuePos.load(boost::memory_order_relaxed), tail = _enqueuePos.load(boost::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+	size_t capacity() const {
+		return _cells.size();
+	}
+
+private:
+	BoundedQueue(const BoundedQueue &);
+	BoundedQueue &operator=(const BoundedQueue &);
+
+	static size_t roundUp(size_t capacity) {
+		size_t n = 2;
+		while (n < capacity)
+			n <<= 1;
+		return n;
+	}
+
+	struct Cell {
+		boost::atomic<size_t> _seq;
+		T _value;
+		Cell() : _seq(0), _value() {}
+		Cell(const Cell &rhs) : _seq(rhs._seq.load()), _value(rhs._value) {}
+	};
+
+	// producers and consumers each spin on their own cache line
+	char _pad0[CacheLineSize];
+	std::vector< Cell > _cells;
+	size_t _mask;
+	char _pad1[CacheLineSize];
+	boost::atomic<size_t> _enqueuePos;
+	char _pad2[CacheLineSize];
+	boost::atomic<size_t> _dequeuePos;
+	char _pad3[CacheLineSize];
+};
+
+#endif // _BOUNDED_QUEUE_HPP
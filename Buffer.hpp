@@ -6,16 +6,25 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <iostream>
+#include <list>
 #include <sstream>
+#include <vector>
 
+#include <boost/atomic.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
-#include <boost/lockfree/queue.hpp>
 #include <boost/lockfree/stack.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "BoundedQueue.hpp"
+#include "BufferTrace.hpp"
+
 #define LOG(msg) { std::stringstream s; s << "T" << boost::this_thread::get_id() << ": " << msg << std::endl; std::string str = s.str(); std::cerr << str; }
 
 class Buffer {
@@ -24,7 +33,7 @@ public:
 	typedef int32_t Size;
 	const static Size DefaultSize = 8192;
 
-	Buffer(Size size = DefaultSize) : _buf(NULL), _gptr(NULL), _pptr(NULL), _mark(0), _capacity(0) {
+	Buffer(Size size = DefaultSize) : _buf(NULL), _gptr(NULL), _pptr(NULL), _mark(0), _capacity(0), _records(-1), _marks(0), _viewOf(NULL), _refs(0) {
 		resize(size);
 	}
 	~Buffer() {
@@ -39,6 +48,11 @@ public:
 		_gptr = _buf;
 		_pptr = _buf + mark;
 		_mark = mark;
+		if (mark == 0) {
+			_marks = 0;
+			if (isIndexed())
+				_records = 0;
+		}
 	}
 	bool empty() const {
 		assert( validate() );
@@ -47,16 +61,23 @@ public:
 
 	// alter capacity.  Can only decrease down to size()
 	void resize(Size newsize) {
+		assert( _viewOf == NULL );
 		assert( _capacity == 0 || validate() );
 		if (newsize == _capacity)
 			return;
 		Size glen = _gptr - _buf;
 		Size plen = size();
-		if (glen >= newsize || plen >= newsize) {
+		Size trailer = getIndexBytes();
+		if (glen >= newsize || plen + trailer + (isIndexed() ? (Size) sizeof(Size) : 0) >= newsize) {
 			return;
 		}
+		// the record index trailer stays at the end of the buffer
+		if (trailer > 0 && newsize < _capacity)
+			memmove(_buf + newsize - trailer, _buf + _capacity - trailer, trailer);
 		_buf = (charPtr) realloc(_buf, newsize);
 		assert(_buf != NULL);
+		if (trailer > 0 && newsize > _capacity)
+			memmove(_buf + newsize - trailer, _buf + _capacity - trailer, trailer);
 		_gptr = _buf + glen;
 		_pptr = _buf + plen;
 		_capacity = newsize;
@@ -95,8 +116,58 @@ public:
 		_mark = size();
 		//LOG( (long) this << "-setMark: " << _mark << ": " << (int) (_pptr - _buf) << " old: " << oldMark );
 		assert(_mark >= oldMark);
+		if (_mark > oldMark) {
+			_marks++;
+			if (isIndexed())
+				appendIndex(_mark);
+		}
 		return _mark - oldMark;
 	}
+	// non-empty records marked since the last clear()
+	Size getMarkCount() const {
+		return _marks;
+	}
+
+	// Optional record index: each setMark() appends the end offset of the record to a
+	// trailer at the end of the buffer (growing down towards pend()), so records can be
+	// found by number without parsing.  Only enable on an empty buffer.
+	void setIndexed(bool indexed) {
+		assert( size() == 0 || indexed == isIndexed() );
+		_records = indexed ? 0 : -1;
+	}
+	bool isIndexed() const {
+		return _records >= 0;
+	}
+	// records indexed so far (0 if not indexed)
+	Size getRecordCount() const {
+		return _records > 0 ? _records : 0;
+	}
+	// offset of the first byte of record i
+	Size getRecordBegin(Size i) const {
+		return i == 0 ? 0 : getRecordEnd(i - 1);
+	}
+	// offset past the last byte of record i
+	Size getRecordEnd(Size i) const {
+		assert( i >= 0 && i < getRecordCount() );
+		Size end;
+		memcpy(&end, indexSlot(i), sizeof(Size));
+		return end;
+	}
+	// the record containing offset (getRecordCount() if past the last record)
+	Size findRecord(Size offset) const {
+		Size lo = 0, hi = getRecordCount();
+		while (lo < hi) {
+			Size mid = lo + (hi - lo) / 2;
+			if (getRecordEnd(mid) <= offset)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+	Size getIndexBytes() const {
+		return getRecordCount() * sizeof(Size);
+	}
 
 	// return the last mark that was set
 	Size getMark() const {
@@ -138,7 +209,11 @@ public:
 		return _pptr;
 	}
 	const charPtr pend() const {
-		return end();
+		if (!isIndexed())
+			return end();
+		// keep room for the next index slot
+		charPtr p = end() - (_records + 1) * sizeof(Size);
+		return p > _pptr ? p : _pptr;
 	}
 
 	// iterator starting at last mark until the end of the put data
@@ -213,6 +288,46 @@ public:
 		std::swap(_pptr, rhs._pptr);
 		std::swap(_mark, rhs._mark);
 		std::swap(_capacity, rhs._capacity);
+		std::swap(_records, rhs._records);
+		std::swap(_marks, rhs._marks);
+		std::swap(_viewOf, rhs._viewOf);
+		int32_t refs = _refs.load();
+		_refs = rhs._refs.load();
+		rhs._refs = refs;
+	}
+
+	// make this (empty, i.e. Buffer(0)) Buffer a read-only view of src's data with its own get pointer.
+	// Used to share one Buffer between several readers
+	void view(Buffer &src) {
+		assert( _viewOf == NULL && _buf == NULL );
+		_buf = _gptr = src._buf;
+		_pptr = src._pptr;
+		_mark = src._mark;
+		_capacity = src._capacity;
+		_records = src._records;
+		_marks = src._marks;
+		_viewOf = &src;
+	}
+	// detach from the viewed Buffer, returning it
+	Buffer *unview() {
+		Buffer *src = _viewOf;
+		_buf = _gptr = _pptr = NULL;
+		_mark = _capacity = 0;
+		_records = -1;
+		_marks = 0;
+		_viewOf = NULL;
+		return src;
+	}
+	bool isView() const {
+		return _viewOf != NULL;
+	}
+
+	// reference count for a Buffer shared by views. returns the remaining references
+	int addRefs(int n) {
+		return _refs += n;
+	}
+	int releaseRef() {
+		return --_refs;
 	}
 
 	std::string getState() const {
@@ -232,7 +347,9 @@ public:
 protected:
 	// release memory
 	void reset() {
-		free(_buf);
+		if (_viewOf == NULL)
+			free(_buf);
+		_viewOf = NULL;
 		_buf = _gptr = _pptr = NULL;
 		_mark = _capacity = 0;
 	}
@@ -248,14 +365,91 @@ protected:
 	bool pvalidate() const {
 		return (_pptr - _buf >= 0 && _pptr - _buf <= _capacity);
 	}
+
+	const char *indexSlot(Size i) const {
+		return end() - (i + 1) * sizeof(Size);
+	}
+	void appendIndex(Size recordEnd) {
+		charPtr slot = end() - (_records + 1) * sizeof(Size);
+		assert( slot >= _pptr );
+		memcpy(slot, &recordEnd, sizeof(Size));
+		_records++;
+	}
 	
 private:
 	// Note: could refactor to be 24bytes, not 32bytes
 	charPtr _buf, _gptr, _pptr;
 	Size _mark, _capacity;
+	Size _records; // -1 when not indexed
+	Size _marks;
+	Buffer *_viewOf;
+	boost::atomic<int32_t> _refs;
 
 };
 
+// notified when a BufferFifo or BufferPool may have become ready,
+// so non-blocking consumers (i.e. coroutines) can wait without holding a thread
+class BufferWaiter {
+public:
+	virtual ~BufferWaiter() {}
+	virtual void notify() = 0;
+};
+
+class BufferWaiterList {
+public:
+	BufferWaiterList() : _count(0) {}
+	void add(BufferWaiter *w) {
+		boost::unique_lock< boost::mutex > l(_mutex);
+		_waiters.push_back(w);
+		_count++;
+	}
+	// returns false if w was already notified (or never added)
+	bool remove(BufferWaiter *w) {
+		boost::unique_lock< boost::mutex > l(_mutex);
+		for (std::list< BufferWaiter* >::iterator it = _waiters.begin(); it != _waiters.end(); it++) {
+			if (*it == w) {
+				_waiters.erase(it);
+				_count--;
+				return true;
+			}
+		}
+		return false;
+	}
+	void notifyOne() {
+		if (_count.load() == 0)
+			return;
+		BufferWaiter *w = NULL;
+		{
+			boost::unique_lock< boost::mutex > l(_mutex);
+			if (_waiters.empty())
+				return;
+			w = _waiters.front();
+			_waiters.pop_front();
+			_count--;
+		}
+		w->notify();
+	}
+	void notifyAll() {
+		if (_count.load() == 0)
+			return;
+		std::list< BufferWaiter* > waiters;
+		{
+			boost::unique_lock< boost::mutex > l(_mutex);
+			waiters.swap(_waiters);
+			_count = 0;
+		}
+		for (std::list< BufferWaiter* >::iterator it = waiters.begin(); it != waiters.end(); it++)
+			(*it)->notify();
+	}
+	int size() const {
+		return _count.load();
+	}
+private:
+	boost::mutex _mutex;
+	std::list< BufferWaiter* > _waiters;
+	boost::atomic<int> _count;
+};
+
 class BufferPool {
 public:
 	typedef Buffer::Size Size;
@@ -263,7 +457,7 @@ public:
 	typedef boost::lockfree::stack< BufferPtr > Stack;
 	typedef boost::shared_ptr< Stack > StackPtr;
 	BufferPool(int capacity = 8, Size bufferSize = Buffer::DefaultSize) 
-		: _stack(new Stack( capacity )), _bufferSize(bufferSize), _allocCount(0), _deallocCount(0), _stackDelay(0) {}
+		: _stack(new Stack( capacity )), _bufferSize(bufferSize), _allocCount(0), _deallocCount(0), _stackDelay(0), _shrinkOversized(false) {}
 	~BufferPool() {
 		clear();
 	}
@@ -300,7 +494,7 @@ public:
 		if (p == NULL && allocNew) {
 			p = getNewBuffer();
 		}
-		if (p != NULL && p->capacity() < getBufferSize() ) {
+		if (p != NULL && (p->capacity() < getBufferSize() || (_shrinkOversized && p->capacity() > 2 * getBufferSize())) ) {
 			p->resize( getBufferSize() );
 		}
 		return p;
@@ -323,8 +517,10 @@ public:
 		if (!ret && allowGrowth) {
 			ret = _stack->push(p);
 		}
-		if (ret)
+		if (ret) {
 			_pushCond.notify_one();
+			_waiters.notifyOne();
+		}
 
 		if (!ret) {
 			delete p;
@@ -340,6 +536,13 @@ public:
 			oldSize = _bufferSize.load();
 		}
 	}
+	// unlike setBufferSize() may shrink.  With shrinkOversized, pooled Buffers over twice the size are shrunk when handed out
+	void resetBufferSize(Size newSize, bool shrinkOversized) {
+		_bufferSize = newSize;
+		_shrinkOversized = shrinkOversized;
+	}
+	bool empty() const { return _stack->empty(); }
+	BufferWaiterList &getWaiters() { return _waiters; }
 	int64_t getAllocCount() const { return _allocCount; }
 	int64_t getDeallocCount() const { return _deallocCount; }
 
@@ -371,42 +574,257 @@ private:
 	boost::condition_variable _pushCond, _popCond;
 	boost::atomic<Size> _bufferSize;
 	boost::atomic<int64_t> _allocCount, _deallocCount, _stackDelay;
+	bool _shrinkOversized;
+	BufferWaiterList _waiters;
+};
+
+// Chooses a BufferFifo's buffer size and pool capacity from its traffic (see BufferFifo::setAutoTune).
+// Each push samples the Buffer's fill, its records, the queue depth and the Buffers in-flight.
+// Every Window pushes one pusher evaluates the window:
+//   mostly empty Buffers (flushed early) shrink the buffer size towards the pushed sizes,
+//   full Buffers holding large records, or a full queue, double it;
+//   waiting on the pool, or in-flight Buffers near its capacity, double the pool capacity,
+//   and under a quarter in-flight halves it.
+class BufferTuner {
+public:
+	typedef Buffer::Size Size;
+	const static int Window = 256;
+	const static int Buckets = 32; // log2 histogram of pushed bytes
+
+	BufferTuner() : _enabled(false), _minSize(0), _maxSize(0), _minPool(0), _maxPool(0),
+		_pushes(0), _bytes(0), _capacity(0), _records(0), _depth(0), _inFlight(0),
+		_lastPoolWait(0), _lastPushFull(0), _decisions(0), _resized(0), _fill(0), _meanRecord(0), _pushBytes(0), _meanDepth(0), _meanInFlight(0) {
+		for (int i = 0; i < Buckets; i++)
+			_histogram[i] = 0;
+	}
+
+	void setBounds(Size minSize, Size maxSize, long minPool, long maxPool) {
+		_minSize = minSize;
+		_maxSize = std::max(minSize, maxSize);
+		_minPool = minPool;
+		_maxPool = std::max(minPool, maxPool);
+	}
+	void setEnabled(bool enabled) {
+		_enabled = enabled;
+	}
+	bool isEnabled() const {
+		return _enabled.load();
+	}
+
+	// returns true when a window is complete and decide() is due
+	bool sample(Size bytes, Size capacity, Size records, long queueDepth, int64_t inFlight) {
+		_bytes += bytes;
+		_capacity += capacity;
+		_records += records;
+		_depth += queueDepth;
+		_inFlight += inFlight;
+		_histogram[log2(bytes)]++;
+		return (++_pushes % Window) == 0;
+	}
+
+	// evaluates and resets the window, given the fifo's running totals of pool wait and full pushes.
+	// returns false if another thread is deciding
+	bool decide(Size &bufferSize, long &poolCapacity, int64_t poolWaitTotal_us, int64_t pushFullTotal) {
+		boost::unique_lock< boost::mutex > l(_mutex, boost::try_to_lock);
+		if (!l.owns_lock())
+			return false;
+		int64_t poolWait_us = poolWaitTotal_us - _lastPoolWait, pushFull = pushFullTotal - _lastPushFull;
+		_lastPoolWait = poolWaitTotal_us;
+		_lastPushFull = pushFullTotal;
+		int64_t bytes = _bytes.exchange(0), capacity = _capacity.exchange(0), records = _records.exchange(0);
+		int64_t n = 0, counts[Buckets];
+		for (int i = 0; i < Buckets; i++)
+			n += (counts[i] = _histogram[i].exchange(0));
+		if (n == 0 || capacity == 0)
+			return false;
+		_fill = (double) bytes / capacity;
+		_meanRecord = records > 0 ? bytes / records : bytes / n;
+		_meanDepth = _depth.exchange(0) / n;
+		_meanInFlight = _inFlight.exchange(0) / n;
+		// upper bound of the 90th percentile pushed bytes
+		int64_t seen = 0;
+		int b = 0;
+		while (b < Buckets - 1 && (seen += counts[b]) < n * 9 / 10)
+			b++;
+		_pushBytes = ((int64_t) 1) << (b + 1);
+
+		Size target = bufferSize;
+		if (_fill < 0.5 && pushFull == 0) {
+			// Buffers leave mostly empty: smaller ones hold the same records with less memory
+			target = (Size) std::max(_pushBytes, 8 * _meanRecord);
+			target = std::max(target, bufferSize / 2);
+		} else if (_fill > 0.85 && (pushFull > 0 || 16 * _meanRecord > bufferSize)) {
+			target = bufferSize * 2;
+		}
+		target = std::min(std::max(target, _minSize), _maxSize);
+		target = (target + 63) & ~((Size) 63);
+
+		long pool = poolCapacity;
+		if (poolWait_us > 0 || _meanInFlight * 4 > pool * 3)
+			pool *= 2;
+		else if (_meanInFlight * 4 < pool)
+			pool /= 2;
+		pool = std::min(std::max(pool, _minPool), _maxPool);
+
+		if (target != bufferSize || pool != poolCapacity)
+			_resized++;
+		_decisions++;
+		bufferSize = target;
+		poolCapacity = pool;
+		return true;
+	}
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "fill: " << _fill << " meanRecord: " << _meanRecord << " p90Push: " << _pushBytes << " queueDepth: " << _meanDepth;
+		ss << " inFlight: " << _meanInFlight << " decisions: " << _decisions << "/" << _resized;
+		return ss.str();
+	}
+
+private:
+	static int log2(Size bytes) {
+		int b = 0;
+		while (b < Buckets - 1 && (((Size) 2) << b) <= bytes)
+			b++;
+		return b;
+	}
+
+	boost::atomic<bool> _enabled; // set by the controlling thread, read by pushing ones
+	Size _minSize, _maxSize;
+	long _minPool, _maxPool;
+	boost::mutex _mutex;
+	boost::atomic<int64_t> _pushes, _bytes, _capacity, _records, _depth, _inFlight;
+	boost::atomic<int64_t> _histogram[Buckets];
+	// the last decision, for getState()
+	int64_t _lastPoolWait, _lastPushFull;
+	int64_t _decisions, _resized;
+	double _fill;
+	int64_t _meanRecord, _pushBytes, _meanDepth, _meanInFlight;
 };
 
 class BufferFifo {
 public:
 	typedef Buffer::Size Size;
 	typedef Buffer* BufferPtr;
-	typedef boost::lockfree::queue< BufferPtr > Queue;
+	typedef BoundedQueue< BufferPtr > Queue; // fixed capacity, push fails when full
 	typedef boost::shared_ptr< Queue > QueuePtr;
-	BufferFifo(Size bufferSize = Buffer::DefaultSize, int numBuffers = 256)
-		: _queue(new Queue(numBuffers) ), _pool(numBuffers, bufferSize),
+	// priority lanes, the highest numbered lane is drained first. Lane 0 is for bulk traffic.
+	const static int MaxLanes = 4;
+	const static int DefaultLaneWeight = 8;
+	// what a broadcast does when a subscriber's queue is full
+	enum BroadcastPolicy {
+		BroadcastBlock, // wait for the slow subscriber
+		BroadcastDrop,  // skip the Buffer for the slow subscriber
+		BroadcastSpill  // spill to the subscriber's disk (subscribe() enables setSpill() on it)
+	};
+	BufferFifo(Size bufferSize = Buffer::DefaultSize, int numBuffers = 256, int numLanes = 1)
+		: _numLanes(numLanes < 1 ? 1 : (numLanes > MaxLanes ? (int) MaxLanes : numLanes)), _laneWeight(DefaultLaneWeight), _starved(0), _pool(numBuffers, bufferSize),
 		  _totalReaders(0), _closedReaders(0), _totalWriters(0), _closedWriters(0),
-		  _pushed(0), _popped(0), _pushedAttempts(0), _poppedAttempts(0), _queueDelay(0),
-		  _initialPoolCapacity(numBuffers), _initialBufferSize(bufferSize),
-		  _warningThreshold(4), _isEOF(false) {}
+		  _pushed(0), _popped(0), _pushedAttempts(0), _poppedAttempts(0), _queueDelay(0), _pushFull(0),
+		  _creditBuffers(0), _creditBytes(0), _maxCreditBuffers(0), _maxCreditBytes(0), _creditDelay(0),
+		  _source(NULL), _broadcastDropped(0), _recordIndex(false), _maxDelay(0), _delayedFlushes(0),
+		  _queuedBytes(0), _maxQueuedBytes(0), _spillFd(-1), _spillReadOffset(0), _spillWriteOffset(0), _spillWriteFailures(0), _spillPending(0), _spilledBytes(0),
+		  _poolCapacity(numBuffers), _initialPoolCapacity(numBuffers), _initialBufferSize(bufferSize),
+		  _warningThreshold(4), _failed(false), _isEOF(false) {
+		if (numLanes != _numLanes) {
+			LOG("Warning: BufferFifo supports 1 to " << MaxLanes << " lanes, not " << numLanes);
+		}
+		for (int lane = 0; lane < _numLanes; lane++) {
+			_queues[lane].reset( new Queue(numBuffers) );
+			_laneQueued[lane] = 0;
+		}
+	}
 	~BufferFifo() {
 		clear();
+		if (_spillFd >= 0)
+			close(_spillFd);
 	}
 	
-	void push(BufferPtr &p, long wait_us = 0) {
+	// blocks while the lane's queue is full, waiting wait_us between attempts (0 spins)
+	void push(BufferPtr &p, long wait_us = 0, int lane = 0) {
+		BUFFER_TRACE_START(traceStart);
+		if (!_subscribers.empty()) {
+			broadcast(p, wait_us, lane);
+			return;
+		}
+		if (_maxQueuedBytes > 0 && spill(p, false))
+			return;
+		assert(lane >= 0 && lane < _numLanes);
+		lane = std::min(lane, _numLanes - 1);
+		if (_tuner.isEnabled())
+			sampleTraffic(p->size(), p->capacity(), p->getMarkCount());
+		Size bytes = p->size();
+		_queuedBytes += bytes;
+		BUFFER_TRACE_ASYNC('b', "queued", p, bytes);
 		_pushed++;
 		int attempts = 1;
-		boost::system_time start;
-		while(!_queue->push(p)) {
-			attempts++;
+		boost::system_time fullSince, warnAt;
+		while(!enqueue(p, lane)) {
+			if (_maxQueuedBytes > 0) {
+				// a spilling fifo does not wait for readers, a full queue spills too
+				_queuedBytes -= bytes;
+				_pushed--;
+				BUFFER_TRACE_ASYNC('e', "queued", p, bytes);
+				if (spill(p, true)) {
+					_pushedAttempts += attempts;
+					return;
+				}
+				_queuedBytes += bytes;
+				_pushed++;
+				BUFFER_TRACE_ASYNC('b', "queued", p, bytes);
+			}
+			if (attempts++ == 1) {
+				fullSince = boost::get_system_time();
+				warnAt = fullSince + boost::posix_time::seconds(1);
+			}
 			if (wait_us > 0) {
 				boost::system_time waitStart = boost::get_system_time();
 				boost::unique_lock<boost::mutex> l(_pushMutex);
 				_popCond.timed_wait(l, waitStart + boost::posix_time::microseconds(wait_us));
 				_queueDelay += ( boost::get_system_time() - waitStart).total_microseconds();
+			} else {
+				boost::this_thread::yield();
+			}
+			if (boost::get_system_time() > warnAt) {
+				LOG("Warning: BufferFifo has waited over " << (boost::get_system_time() - fullSince).total_seconds() << "s to push to a full queue (capacity " << _queues[lane]->capacity() << ").  Are the readers running?  Can you initialize BufferFifo with more numBuffers, or call setSpill()?");
+				warnAt += boost::posix_time::seconds(1);
 			}
 		}
-		_pushCond.notify_one();
+		if (attempts > 1)
+			_pushFull++;
 		_pushedAttempts += attempts;
+		BUFFER_TRACE_SPAN("push", traceStart, p, attempts);
 		p = NULL;
 	}
+	// returns false, keeping p, when the lane's queue is full.
+	// Broadcasting and spilling fifos never report full (see subscribe() and setSpill()).
+	bool tryPush(BufferPtr &p, int lane = 0) {
+		if (!_subscribers.empty() || _maxQueuedBytes > 0) {
+			push(p, 0, lane);
+			return true;
+		}
+		assert(lane >= 0 && lane < _numLanes);
+		lane = std::min(lane, _numLanes - 1);
+		_pushedAttempts++;
+		// once enqueued, p belongs to the readers
+		Size bytes = p->size(), capacity = p->capacity(), marks = p->getMarkCount();
+		_queuedBytes += bytes;
+		_pushed++;
+		BUFFER_TRACE_ASYNC('b', "queued", p, bytes);
+		if (!enqueue(p, lane)) {
+			BUFFER_TRACE_ASYNC('e', "queued", p, bytes);
+			_queuedBytes -= bytes;
+			_pushed--;
+			_pushFull++;
+			return false;
+		}
+		if (_tuner.isEnabled())
+			sampleTraffic(bytes, capacity, marks);
+		p = NULL;
+		return true;
+	}
 	bool pop(BufferPtr &p, long wait_us = 1000) {
+		BUFFER_TRACE_START(traceStart);
 		bool ret = false;
 		int attempts = 0;
 		boost::system_time start;
@@ -415,7 +833,11 @@ public:
 		while (!ret && !(_isEOF && empty())) {
 			// do not attempt a pop if there is nothing to pop
 			if (wait_us == 0 || _pushed > _popped) {
-				ret = _queue->pop(p);
+				ret = popLanes(p);
+				if (ret)
+					_queuedBytes -= p->size();
+				else if (_spillPending > 0)
+					ret = unspill(p);
 				attempts++;
 			}
 			if (wait_us > 0 && !ret) {
@@ -430,23 +852,145 @@ public:
 		if (ret) {
 			_popped++;
 			_popCond.notify_one();
+			BUFFER_TRACE_ASYNC('e', "queued", p, p->size());
+			BUFFER_TRACE_SPAN("pop", traceStart, p, p->size());
 		}
 		_poppedAttempts += attempts;
 		return ret;
 	}
-    long getQueueSize() {
+    long getQueueSize() const {
         return _pushed.load() - _popped.load();
     }
     long getInitialPoolCapacity() {
         return _initialPoolCapacity;
     }
 	bool empty() const {
-		return _queue->empty() && _pushed == _popped;
+		for (int lane = 0; lane < _numLanes; lane++)
+			if (!_queues[lane]->empty())
+				return false;
+		return _pushed == _popped;
+	}
+	int getNumLanes() const {
+		return _numLanes;
+	}
+
+	// Spill to disk: once more than maxQueuedBytes are queued in memory (or a lane's queue is full), pushed Buffers are
+	// appended to an anonymous spill file in dir and returned to the pool, and readers drain
+	// them in FIFO order after the in-memory Buffers.  Producers never block on readers.
+	// While anything is spilled, all pushes go to the spill file to keep FIFO order.
+	// Spilled Buffers lose their priority lane.  0 disables spilling, which is the default.
+	bool setSpill(int64_t maxQueuedBytes, const std::string &dir = "/tmp") {
+		boost::unique_lock< boost::mutex > l(_spillMutex);
+		if (maxQueuedBytes > 0 && _spillFd < 0) {
+			std::string path = dir + "/BufferFifo.spill.XXXXXX";
+			std::vector< char > name(path.begin(), path.end());
+			name.push_back('\0');
+			_spillFd = mkstemp(&name[0]);
+			if (_spillFd < 0) {
+				LOG("Warning: BufferFifo could not create a spill file in " << dir);
+				return false;
+			}
+			unlink(&name[0]);
+		}
+		_maxQueuedBytes = maxQueuedBytes;
+		return true;
+	}
+	int64_t getQueuedBytes() const {
+		return _queuedBytes.load();
+	}
+	int64_t getSpilledBytes() const {
+		return _spilledBytes.load();
+	}
+	long getSpillPending() const {
+		return _spillPending.load();
+	}
+
+	// index every record (setMark) in the Buffers handed out by getBuffer()
+	void setRecordIndex(bool recordIndex) {
+		_recordIndex = recordIndex;
+	}
+	bool getRecordIndex() const {
+		return _recordIndex;
+	}
+
+	// Self-tuning: sample the pushed Buffers and adjust the buffer size and the pool capacity
+	// (where getBuffer() starts to throttle and returnBuffer() frees Buffers) within bounds, see BufferTuner.
+	// 0 bounds default to 1/16 and 16 times the initial bufferSize and numBuffers.
+	void setAutoTune(bool enable, Size minBufferSize = 0, Size maxBufferSize = 0, long minPoolCapacity = 0, long maxPoolCapacity = 0) {
+		_tuner.setBounds(minBufferSize > 0 ? minBufferSize : std::max((Size) 256, _initialBufferSize / 16),
+				maxBufferSize > 0 ? maxBufferSize : 16 * _initialBufferSize,
+				minPoolCapacity > 0 ? minPoolCapacity : std::max((Size) 1, _initialPoolCapacity / 16),
+				maxPoolCapacity > 0 ? maxPoolCapacity : 16 * _initialPoolCapacity);
+		_tuner.setEnabled(enable);
+		if (!enable)
+			_pool.resetBufferSize(getBufferSize(), false);
+	}
+	bool isAutoTune() const {
+		return _tuner.isEnabled();
+	}
+	long getPoolCapacity() const {
+		return _poolCapacity.load();
+	}
+
+	// latency bound for the marked_ostreams created after this call: records are coalesced
+	// into full Buffers, but pushed within maxDelay_us of their setMark() (see marked_fifo_streambuf::setMaxDelay)
+	// as long as the writers keep calling setMark() or flushIfDue(); the fifo has no timer.
+	// 0 disables it, which is the default.
+	void setMaxDelay(long maxDelay_us) {
+		_maxDelay = maxDelay_us;
+	}
+	long getMaxDelay() const {
+		return _maxDelay;
+	}
+	// Buffers pushed before they were full because of a max delay
+	void countDelayedFlush() {
+		_delayedFlushes++;
+	}
+	int64_t getDelayedFlushes() const {
+		return _delayedFlushes.load();
+	}
+
+	// Broadcast: every Buffer pushed to this fifo is delivered to each subscriber fifo
+	// (and so to all of their marked_istreams) instead of being queued here.
+	// Subscribers receive reference counted read-only views, and the Buffer returns to this
+	// fifo's pool (and credit) when the last subscriber releases it.
+	// Subscribe before any writer pushes, and destroy subscribers before this fifo.
+	// maxQueued (0 uses the subscriber's pool capacity) is when a subscriber is slow.
+	// BroadcastSpill enables setSpill() on the subscriber, at maxQueued Buffers, unless it already spills,
+	// and falls back to BroadcastBlock if it cannot.
+	void subscribe(BufferFifo &subscriber, BroadcastPolicy policy = BroadcastBlock, long maxQueued = 0) {
+		assert(subscriber._source == NULL && &subscriber != this);
+		if (_viewShells.get() == NULL)
+			_viewShells.reset( new BufferPool::Stack( _initialPoolCapacity ) );
+		if (maxQueued <= 0)
+			maxQueued = subscriber.getInitialPoolCapacity();
+		if (policy == BroadcastSpill && subscriber._maxQueuedBytes == 0 && !subscriber.setSpill(maxQueued * (int64_t) subscriber.getBufferSize())) {
+			LOG("Warning: BufferFifo subscriber cannot spill, it will block the broadcast instead");
+			policy = BroadcastBlock;
+		}
+		subscriber._source = this;
+		_subscribers.push_back( Subscriber(&subscriber, policy, maxQueued) );
+	}
+	int getSubscriberCount() const {
+		return _subscribers.size();
+	}
+	// Buffers this subscriber missed under BroadcastDrop
+	int64_t getBroadcastDropped() const {
+		return _broadcastDropped.load();
+	}
+	long getLaneQueueSize(int lane) const {
+		return _laneQueued[lane].load();
+	}
+	// anti-starvation: after this many consecutive pops from higher lanes
+	// while a lower lane is waiting, the lowest waiting lane is served once
+	void setLaneWeight(int weight) {
+		_laneWeight = std::max(1, weight);
 	}
 	bool isEOF() const {
 		return _isEOF && empty();
 	}
 	void setEOF() {
+		BUFFER_TRACE_INSTANT("EOF", this, getQueueSize());
 		if (_isEOF) {
 			LOG("Warning: you should only setEOF once per program not per thread");
 		}
@@ -455,10 +999,26 @@ public:
 		if (count != 0) {
 			LOG("Warning: there are still active writers (" << count << ") when setEOF() was called... Chaos shall follow");
 		}
+		for (size_t i = 0; i < _subscribers.size(); i++)
+			_subscribers[i].fifo->setEOF();
 		_pushCond.notify_all();
+		_waiters.notifyAll();
+	}
+
+	// a writer (i.e. a BufferFifoSocketReceiver) or the spill file lost data: readers still reach EOF,
+	// and isOk() tells the truncated stream from a clean end
+	void setFailed() {
+		if (!_failed.exchange(true)) {
+			LOG("Warning: BufferFifo is failed, the stream is truncated");
+		}
+	}
+	bool isOk() const {
+		return !_failed.load();
 	}
 
 	BufferPool &getBufferPool() { return _pool; }
+	// notified on every push and at EOF
+	BufferWaiterList &getWaiters() { return _waiters; }
 
 	Size getOutstanding() const {
 		Size poolOutstanding = _pool.getOutstanding();
@@ -467,11 +1027,11 @@ public:
 
 	long getWaitForBuffer() {
 		long wait_us = 0;
-		double outstanding = getOutstanding(), capacity = _initialPoolCapacity;
-		if (!_isEOF && outstanding > _initialPoolCapacity) {
-			if (outstanding > _warningThreshold * _initialPoolCapacity) {
+		double outstanding = getOutstanding(), capacity = _poolCapacity.load();
+		if (!_isEOF && outstanding > capacity) {
+			if (outstanding > _warningThreshold * capacity) {
 				_warningThreshold *= 2;
-				LOG("Warning: BufferFifo pool capacity (" << _initialPoolCapacity << ") is being eclipsed by the outstanding buffers (" << outstanding << ").  Please consider increasing the initial poolCapacity");
+				LOG("Warning: BufferFifo pool capacity (" << capacity << ") is being eclipsed by the outstanding buffers (" << outstanding << ").  Please consider increasing the initial poolCapacity");
 			}
 			wait_us = (10 * outstanding * outstanding * outstanding ) / ( capacity * capacity * capacity );
 			//LOG("getWaitForBuffer(): " << wait_us << "us. outstandingBufferPool: " << outstanding << ", " << capacity << " pushed: " << _pushed.load() << " popped: " << _popped.load() << " inqueue: "<< (_pushed.load() - _popped.load()));
@@ -479,15 +1039,79 @@ public:
 		return wait_us;
 	}
 
+	// blocks while the credit limit is exhausted
 	BufferPtr getBuffer() {
-		return _pool.getBuffer(getWaitForBuffer(), true);
+		BUFFER_TRACE_START(start);
+		Size bytes = getBufferSize();
+		acquireCredit(bytes, true);
+		BufferPtr p = getCreditedBuffer(bytes);
+		BUFFER_TRACE_SPAN("getBuffer", start, p, p->capacity());
+		return p;
+	}
+
+	// returns NULL instead of blocking when the credit limit is exhausted
+	BufferPtr tryGetBuffer() {
+		Size bytes = getBufferSize();
+		if (!acquireCredit(bytes, false))
+			return NULL;
+		BufferPtr p = getCreditedBuffer(bytes);
+		BUFFER_TRACE_INSTANT("getBuffer", p, p->capacity());
+		return p;
 	}
 
-	bool returnBuffer(BufferPtr &p) {
-		return _pool.returnBuffer(p,  getWaitForBuffer(), true);
+	// returns the credit held by p, typically once a reader has consumed it.
+	// Without wait, a full pool frees p rather than waiting for room
+	bool returnBuffer(BufferPtr &p, bool wait = true) {
+		BUFFER_TRACE_INSTANT("returnBuffer", p, p->size());
+		if (p->isView()) {
+			releaseView(p, wait);
+			return true;
+		}
+		releaseCredit(p->capacity());
+		// a tuned pool frees the Buffers beyond its capacity
+		bool allowGrowth = !_tuner.isEnabled() || getOutstanding() <= _poolCapacity.load();
+		return _pool.returnBuffer(p, wait ? getWaitForBuffer() : 0, allowGrowth);
 	}
 
-	Size getBufferSize() {
+	// grow a Buffer obtained from getBuffer(), charging the extra capacity to the credit
+	void resizeBuffer(BufferPtr p, Size newsize) {
+		Size oldCapacity = p->capacity();
+		p->resize(newsize);
+		_creditBytes += p->capacity() - oldCapacity;
+	}
+
+	// hand-off without copying: p, a Buffer from the other fifo's getBuffer(), becomes this fifo's
+	// and the other fifo gets one of this fifo's Buffers in exchange, so neither pool grows.
+	// The credit follows the Buffers, whatever their capacities
+	void adoptBuffer(BufferPtr p, BufferFifo &from) {
+		assert(!p->isView() && &from != this);
+		BufferPtr spare = getBuffer();
+		_creditBytes += p->capacity() - spare->capacity();
+		from._creditBytes += spare->capacity() - p->capacity();
+		from.returnBuffer(spare);
+	}
+
+	// Credit based flow control: bound the Buffers (and bytes of capacity) that are in-flight,
+	// i.e. obtained by getBuffer() and not yet given back by returnBuffer().
+	// Writers block in getBuffer() (or fail in tryGetBuffer()) until readers return Buffers.
+	// Every stream holds a Buffer while it is writing or reading one, so limits must exceed the number of active streams.
+	// 0 disables a limit, which is the default.
+	void setCreditLimit(int maxBuffers, int64_t maxBytes = 0) {
+		boost::unique_lock< boost::mutex > l(_creditMutex);
+		_maxCreditBuffers = maxBuffers;
+		_maxCreditBytes = maxBytes;
+		_creditCond.notify_all();
+	}
+	bool hasCreditLimit() const {
+		return _maxCreditBuffers > 0 || _maxCreditBytes > 0;
+	}
+	bool hasCredit() const {
+		return creditAvailable(getBufferSize());
+	}
+	int64_t getCreditBuffers() const { return _creditBuffers.load(); }
+	int64_t getCreditBytes() const { return _creditBytes.load(); }
+
+	Size getBufferSize() const {
 		return _pool.getBufferSize();
 	}
 
@@ -501,7 +1125,9 @@ public:
 	}
 
 	void swap(BufferFifo &rhs) {
-		std::swap(_queue, rhs._queue);
+		assert(_numLanes == rhs._numLanes);
+		for (int lane = 0; lane < _numLanes; lane++)
+			std::swap(_queues[lane], rhs._queues[lane]);
 		_pool.swap(rhs._pool);
 	}
 	boost::mutex &getPushMutex() {
@@ -544,28 +1170,348 @@ public:
 		std::stringstream ss;
 		ss << "BufferFifo::getState(): pushed: " << _pushed.load() << "/" << _pushedAttempts.load();
 		ss << " popped: " << _popped.load() << "/" << _poppedAttempts.load() << " queueDelay: " << _queueDelay;
+		ss << " queueCapacity: " << _queues[0]->capacity() << " pushFull: " << _pushFull.load();
 		ss << " allocated: " << _pool.getAllocCount() << " deallocated: " << _pool.getDeallocCount() << " bufferDelay: " << _pool.getStackDelay();
+		if (_source != NULL)
+			ss << " broadcastDropped: " << _broadcastDropped.load();
+		if (_spillFd >= 0)
+			ss << " queuedBytes: " << _queuedBytes.load() << " spilledBytes: " << _spilledBytes.load() << " spillPending: " << _spillPending.load() << " spillWriteFailures: " << _spillWriteFailures.load();
+		ss << " inFlight: " << _creditBuffers.load() << "/" << _creditBytes.load() << " creditDelay: " << _creditDelay.load();
+		if (_tuner.isEnabled())
+			ss << " autoTune: bufferSize: " << getBufferSize() << " poolCapacity: " << _poolCapacity.load() << " " << _tuner.getState();
+		if (_maxDelay > 0 || _delayedFlushes.load() > 0)
+			ss << " maxDelay: " << _maxDelay << " delayedFlushes: " << _delayedFlushes.load();
+		if (_failed.load())
+			ss << " failed: 1";
 		ss << " isEOF: " << _isEOF;
 		return ss.str();
 	}
 
 protected:
+	bool creditAvailable(Size bytes) const {
+		int64_t buffers = _creditBuffers.load();
+		// a single Buffer is always allowed so an oversized message can progress
+		return (_maxCreditBuffers <= 0 || buffers < _maxCreditBuffers)
+			&& (_maxCreditBytes <= 0 || buffers == 0 || _creditBytes.load() + bytes <= _maxCreditBytes);
+	}
+	bool acquireCredit(Size bytes, bool block) {
+		if (hasCreditLimit()) {
+			boost::unique_lock< boost::mutex > l(_creditMutex);
+			if (!creditAvailable(bytes)) {
+				if (!block)
+					return false;
+				boost::system_time start = boost::get_system_time();
+				while (!creditAvailable(bytes)) {
+					if (!_creditCond.timed_wait(l, boost::get_system_time() + boost::posix_time::seconds(1)) && !creditAvailable(bytes)) {
+						LOG("Warning: BufferFifo has waited over 1s for credit (" << _creditBuffers.load() << "/" << _maxCreditBuffers << " buffers, " << _creditBytes.load() << "/" << _maxCreditBytes << " bytes).  Is the credit limit smaller than the number of open streams?");
+					}
+				}
+				_creditDelay += (boost::get_system_time() - start).total_microseconds();
+			}
+			_creditBuffers++;
+			_creditBytes += bytes;
+		} else {
+			_creditBuffers++;
+			_creditBytes += bytes;
+		}
+		return true;
+	}
+	void releaseCredit(Size bytes) {
+		_creditBuffers--;
+		_creditBytes -= bytes;
+		if (hasCreditLimit()) {
+			boost::unique_lock< boost::mutex > l(_creditMutex);
+			_creditCond.notify_all();
+		}
+	}
+	// takes the Buffer's numbers, not the Buffer, which a reader may own once it is enqueued
+	void sampleTraffic(Size bytes, Size capacity, Size marks) {
+		if (!_tuner.sample(bytes, capacity, marks, getQueueSize(), _creditBuffers.load()))
+			return;
+		Size size = getBufferSize();
+		long pool = _poolCapacity.load();
+		if (!_tuner.decide(size, pool, _pool.getStackDelay(), _pushFull.load()))
+			return;
+		if (size != getBufferSize())
+			_pool.resetBufferSize(size, true);
+		_poolCapacity = pool;
+	}
+	BufferPtr getCreditedBuffer(Size chargedBytes) {
+		BufferPtr p = _pool.getBuffer(getWaitForBuffer(), true);
+		p->setIndexed(_recordIndex);
+		// the pool may hand out a Buffer that grew beyond the current buffer size
+		_creditBytes += p->capacity() - chargedBytes;
+		return p;
+	}
+
+	bool enqueue(BufferPtr p, int lane) {
+		if (!_queues[lane]->push(p))
+			return false;
+		_laneQueued[lane]++;
+		_pushCond.notify_one();
+		_waiters.notifyOne();
+		return true;
+	}
+
+	// highest lane first, except when a lower lane has been passed over _laneWeight times
+	bool popLanes(BufferPtr &p) {
+		if (_numLanes == 1)
+			return _queues[0]->pop(p);
+		if (_starved.load() >= _laneWeight) {
+			for (int lane = 0; lane < _numLanes; lane++) {
+				if (_laneQueued[lane].load() > 0 && _queues[lane]->pop(p)) {
+					_laneQueued[lane]--;
+					_starved = 0;
+					return true;
+				}
+			}
+		}
+		for (int lane = _numLanes - 1; lane >= 0; lane--) {
+			if (_queues[lane]->pop(p)) {
+				_laneQueued[lane]--;
+				bool lowerWaiting = false;
+				for (int lower = 0; lower < lane && !lowerWaiting; lower++)
+					lowerWaiting = _laneQueued[lower].load() > 0;
+				if (lowerWaiting)
+					_starved++;
+				else
+					_starved = 0;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void broadcast(BufferPtr &p, long wait_us, int lane) {
+		std::vector< BufferFifo* > targets;
+		targets.reserve(_subscribers.size());
+		for (size_t i = 0; i < _subscribers.size(); i++) {
+			Subscriber &sub = _subscribers[i];
+			if (sub.fifo->getQueueSize() >= sub.maxQueued) {
+				if (sub.policy == BroadcastDrop) {
+					sub.fifo->_broadcastDropped++;
+					continue;
+				}
+				if (sub.policy == BroadcastBlock) {
+					boost::system_time start = boost::get_system_time();
+					boost::unique_lock< boost::mutex > l(sub.fifo->getPushMutex());
+					while (sub.fifo->getQueueSize() >= sub.maxQueued)
+						sub.fifo->getPopCondition().timed_wait(l, boost::get_system_time() + boost::posix_time::milliseconds(1));
+					_queueDelay += (boost::get_system_time() - start).total_microseconds();
+				}
+			}
+			targets.push_back(sub.fifo);
+		}
+		_pushed++;
+		_popped++;
+		if (targets.empty()) {
+			returnBuffer(p);
+			p = NULL;
+			return;
+		}
+		// all references before any view is visible to a reader
+		p->addRefs(targets.size());
+		for (size_t i = 0; i < targets.size(); i++) {
+			BufferPtr v = NULL;
+			if (!_viewShells->pop(v))
+				v = new Buffer(0);
+			v->view(*p);
+			targets[i]->push(v, wait_us, std::min(lane, targets[i]->getNumLanes() - 1));
+		}
+		p = NULL;
+	}
+
+	struct SpillHeader {
+		Size bytes, mark, records; // records is -1 for an unindexed Buffer
+	};
+
+	// returns false if p should be queued in memory. force spills even under maxQueuedBytes, i.e. when the queue is full
+	bool spill(BufferPtr &p, bool force) {
+		boost::unique_lock< boost::mutex > l(_spillMutex);
+		if (_spillFd < 0 || (!force && _spillPending == 0 && _queuedBytes.load() + p->size() <= _maxQueuedBytes))
+			return false;
+		SpillHeader h;
+		h.bytes = p->size();
+		h.mark = p->getMark();
+		h.records = p->isIndexed() ? p->getRecordCount() : -1;
+		std::vector< Size > ends(h.records > 0 ? h.records : 0);
+		for (Size i = 0; i < h.records; i++)
+			ends[i] = p->getRecordEnd(i);
+		// a partly written Buffer is overwritten by the next spill, so unspill() never sees it
+		int64_t writeOffset = _spillWriteOffset;
+		bool ok = spillWrite(&h, sizeof(h)) && spillWrite(p->begin(), h.bytes)
+			&& (ends.empty() || spillWrite(&ends[0], ends.size() * sizeof(Size)));
+		if (!ok) {
+			_spillWriteOffset = writeOffset;
+			// push() retries a forced spill while the queue is full, so only the first failure warns
+			if (_spillWriteFailures++ == 0) {
+				LOG("Warning: BufferFifo could not write to the spill file, queueing in memory");
+			}
+			return false;
+		}
+		_spilledBytes += h.bytes;
+		BUFFER_TRACE_INSTANT("spill", p, h.bytes);
+		_spillPending++;
+		_pushed++;
+		l.unlock();
+		// the writer must not wait on the pool either
+		returnBuffer(p, false);
+		p = NULL;
+		_pushCond.notify_one();
+		_waiters.notifyOne();
+		return true;
+	}
+	bool spillWrite(const void *src, size_t bytes) {
+		if (bytes == 0)
+			return true;
+		ssize_t n = pwrite(_spillFd, src, bytes, _spillWriteOffset);
+		if (n != (ssize_t) bytes)
+			return false;
+		_spillWriteOffset += bytes;
+		return true;
+	}
+	bool spillRead(void *dst, size_t bytes) {
+		if (bytes == 0)
+			return true;
+		ssize_t n = pread(_spillFd, dst, bytes, _spillReadOffset);
+		if (n != (ssize_t) bytes)
+			return false;
+		_spillReadOffset += bytes;
+		return true;
+	}
+
+	// the oldest spilled Buffer, read into a fresh pool Buffer.
+	// If the spill file cannot be read, everything spilled is dropped and the fifo is failed,
+	// so the readers still reach EOF
+	bool unspill(BufferPtr &p) {
+		boost::unique_lock< boost::mutex > l(_spillMutex);
+		if (_spillPending == 0)
+			return false;
+		SpillHeader h;
+		if (!spillRead(&h, sizeof(h)) || h.bytes < 0 || h.mark < 0 || h.mark > h.bytes || h.records < -1) {
+			dropSpilled(l);
+			return false;
+		}
+		// readers must not block on credit, so charge it unconditionally
+		p = _pool.getBuffer(0, true);
+		p->setIndexed(h.records >= 0);
+		Size needed = h.bytes + (h.records >= 0 ? (h.records + 1) * (Size) sizeof(Size) : 0);
+		if (p->capacity() < needed)
+			p->resize(needed);
+		_creditBuffers++;
+		_creditBytes += p->capacity();
+		std::vector< Size > ends(h.records > 0 ? h.records : 0);
+		bool ok = spillRead(p->begin(), h.bytes) && (ends.empty() || spillRead(&ends[0], ends.size() * sizeof(Size)));
+		for (size_t i = 0; ok && i < ends.size(); i++)
+			ok = ends[i] >= (i == 0 ? 0 : ends[i-1]) && ends[i] <= h.bytes;
+		if (!ok) {
+			returnBuffer(p, false);
+			p = NULL;
+			dropSpilled(l);
+			return false;
+		}
+		// replay the marks to rebuild the mark and record index
+		for (size_t i = 0; i < ends.size(); i++) {
+			p->pbump(ends[i] - p->size());
+			p->setMark();
+		}
+		if (h.mark > p->size()) {
+			p->pbump(h.mark - p->size());
+			p->setMark();
+		}
+		p->pbump(h.bytes - p->size());
+		if (--_spillPending == 0) {
+			// everything spilled was read, reclaim the disk
+			_spillReadOffset = _spillWriteOffset = 0;
+			if (ftruncate(_spillFd, 0) != 0) {
+				LOG("Warning: BufferFifo could not truncate the spill file");
+			}
+		}
+		return true;
+	}
+	// releases l, the _spillMutex, before waking the readers
+	void dropSpilled(boost::unique_lock< boost::mutex > &l) {
+		LOG("Warning: BufferFifo could not read the spill file, dropping " << _spillPending.load() << " spilled Buffers");
+		_popped += _spillPending.exchange(0);
+		_spillReadOffset = _spillWriteOffset = 0;
+		if (ftruncate(_spillFd, 0) != 0) {
+			LOG("Warning: BufferFifo could not truncate the spill file");
+		}
+		setFailed();
+		l.unlock();
+		_pushCond.notify_all();
+		_waiters.notifyAll();
+	}
+
+	// a subscriber is done with a view of one of the _source's Buffers
+	void releaseView(BufferPtr &v, bool wait = true) {
+		assert(_source != NULL);
+		BufferPtr p = v->unview();
+		if (!_source->_viewShells->push(v))
+			delete v;
+		v = NULL;
+		if (p->releaseRef() == 0)
+			_source->returnBuffer(p, wait);
+	}
+
 	void clear() {
 		BufferPtr p = NULL;
-		while (_queue->pop(p)) {
-			assert(p!=NULL);
-			delete p;
-			p = NULL;
+		for (int lane = 0; lane < _numLanes; lane++) {
+			while (_queues[lane]->pop(p)) {
+				assert(p!=NULL);
+				if (p->isView())
+					releaseView(p);
+				else
+					delete p;
+				p = NULL;
+			}
+		}
+		if (_viewShells.get() != NULL) {
+			while (_viewShells->pop(p)) {
+				delete p;
+				p = NULL;
+			}
 		}
 	}
 
 private:
-	QueuePtr _queue;
+	int _numLanes, _laneWeight;
+	boost::atomic<int> _starved;
+	QueuePtr _queues[MaxLanes];
+	boost::atomic<int64_t> _laneQueued[MaxLanes];
 	BufferPool _pool;
-	boost::atomic<int64_t> _totalReaders, _closedReaders, _totalWriters, _closedWriters, _pushed, _popped, _pushedAttempts, _poppedAttempts, _queueDelay;
-	boost::mutex _pushMutex, _popMutex;
-	boost::condition_variable _pushCond, _popCond;
+	boost::atomic<int64_t> _totalReaders, _closedReaders, _totalWriters, _closedWriters, _pushed, _popped, _pushedAttempts, _poppedAttempts, _queueDelay, _pushFull;
+	boost::atomic<int64_t> _creditBuffers, _creditBytes;
+	int64_t _maxCreditBuffers, _maxCreditBytes;
+	boost::atomic<int64_t> _creditDelay;
+	boost::mutex _pushMutex, _popMutex, _creditMutex;
+	boost::condition_variable _pushCond, _popCond, _creditCond;
+	BufferWaiterList _waiters;
+	struct Subscriber {
+		BufferFifo *fifo;
+		BroadcastPolicy policy;
+		long maxQueued;
+		Subscriber(BufferFifo *f, BroadcastPolicy p, long m) : fifo(f), policy(p), maxQueued(m) {}
+	};
+	std::vector< Subscriber > _subscribers;
+	BufferPool::StackPtr _viewShells;
+	BufferFifo *_source;
+	boost::atomic<int64_t> _broadcastDropped;
+	bool _recordIndex;
+	long _maxDelay;
+	boost::atomic<int64_t> _delayedFlushes;
+	boost::atomic<int64_t> _queuedBytes;
+	int64_t _maxQueuedBytes;
+	boost::mutex _spillMutex;
+	int _spillFd;
+	int64_t _spillReadOffset, _spillWriteOffset;
+	boost::atomic<int64_t> _spillWriteFailures;
+	boost::atomic<long> _spillPending;
+	boost::atomic<int64_t> _spilledBytes;
+	BufferTuner _tuner;
+	boost::atomic<long> _poolCapacity;
 	Size _initialPoolCapacity, _initialBufferSize, _warningThreshold;
+	boost::atomic<bool> _failed;
 	bool _isEOF;
 };
 
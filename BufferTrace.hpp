@@ -0,0 +1,177 @@
+// BufferTrace.hpp
+
+#ifndef _BUFFER_TRACE_HPP
+#define _BUFFER_TRACE_HPP
+
+// Optional tracer of Buffer lifecycle events (getBuffer, push, pop, overflow, underflow,
+// returnBuffer, EOF) written as Chrome trace JSON, loadable in chrome://tracing or Perfetto.
+// Compile with -DBUFFER_TRACE and call BufferTrace::enable() to record; without the define
+// every trace point compiles away.
+// Each thread records into its own fixed size ring (oldest events are overwritten),
+// so recording takes no locks.  dump() once the traced threads are finished.
+
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+class BufferTrace {
+public:
+	const static int DefaultRingSize = 1 << 16;
+
+	struct Event {
+		int64_t ts, dur; // nanoseconds
+		const char *name;
+		const void *id;
+		int64_t bytes;
+		char phase;
+	};
+
+	static void enable(bool enabled = true, int ringSize = DefaultRingSize) {
+		getRingSize() = ringSize;
+		getEnabled() = enabled;
+	}
+	static bool isEnabled() {
+		return getEnabled();
+	}
+
+	static int64_t now() {
+		if (!getEnabled())
+			return 0;
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+	}
+
+	// phase: 'X' span from start to now, 'i' instant, 'b' / 'e' async begin / end keyed by id
+	static void record(char phase, const char *name, int64_t start, const void *id, int64_t bytes) {
+		if (!getEnabled())
+			return;
+		int64_t ts = now();
+		Ring &ring = getRing();
+		Event &e = ring.events[ring.next];
+		e.phase = phase;
+		e.name = name;
+		e.id = id;
+		e.bytes = bytes;
+		if (phase == 'X' && start > 0) {
+			e.ts = start;
+			e.dur = ts - start;
+		} else {
+			e.ts = ts;
+			e.dur = 0;
+		}
+		if (++ring.next == ring.events.size()) {
+			ring.next = 0;
+			ring.wrapped = true;
+		}
+	}
+
+	// write every thread's events as Chrome trace JSON
+	static void dump(std::ostream &os) {
+		boost::unique_lock< boost::mutex > l(getMutex());
+		std::vector< RingPtr > &rings = getRings();
+		os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		bool first = true;
+		for (size_t r = 0; r < rings.size(); r++) {
+			Ring &ring = *rings[r];
+			size_t count = ring.wrapped ? ring.events.size() : ring.next;
+			size_t begin = ring.wrapped ? ring.next : 0;
+			for (size_t i = 0; i < count; i++) {
+				const Event &e = ring.events[(begin + i) % ring.events.size()];
+				os << (first ? "\n" : ",\n");
+				first = false;
+				os << "{\"name\":\"" << e.name << "\",\"cat\":\"buffer\",\"ph\":\"" << e.phase << "\"";
+				os << ",\"ts\":" << std::fixed << std::setprecision(3) << (e.ts / 1000.0);
+				if (e.phase == 'X')
+					os << ",\"dur\":" << (e.dur / 1000.0);
+				if (e.phase == 'i')
+					os << ",\"s\":\"t\"";
+				if (e.phase == 'b' || e.phase == 'e')
+					os << ",\"id\":\"" << e.id << "\"";
+				os << ",\"pid\":1,\"tid\":" << ring.tid;
+				os << ",\"args\":{\"buffer\":\"" << e.id << "\",\"bytes\":" << e.bytes << "}}";
+			}
+		}
+		os << "\n]}" << std::endl;
+	}
+	static bool dump(const std::string &path) {
+		std::ofstream ofs(path.c_str());
+		if (!ofs)
+			return false;
+		dump(ofs);
+		return ofs.good();
+	}
+
+	// forget all recorded events
+	static void clear() {
+		boost::unique_lock< boost::mutex > l(getMutex());
+		std::vector< RingPtr > &rings = getRings();
+		for (size_t r = 0; r < rings.size(); r++) {
+			rings[r]->next = 0;
+			rings[r]->wrapped = false;
+		}
+	}
+
+private:
+	struct Ring {
+		std::vector< Event > events;
+		size_t next;
+		bool wrapped;
+		int tid;
+		Ring(int size, int t) : events(size), next(0), wrapped(false), tid(t) {}
+	};
+	typedef boost::shared_ptr< Ring > RingPtr;
+
+	// rings outlive their threads so they can be dumped
+	static void keepRing(Ring *) {}
+
+	static Ring &getRing() {
+		static boost::thread_specific_ptr< Ring > local(keepRing);
+		Ring *ring = local.get();
+		if (ring == NULL) {
+			boost::unique_lock< boost::mutex > l(getMutex());
+			std::vector< RingPtr > &rings = getRings();
+			rings.push_back( RingPtr( new Ring(getRingSize() > 0 ? getRingSize() : 1, rings.size() + 1) ) );
+			ring = rings.back().get();
+			local.reset(ring);
+		}
+		return *ring;
+	}
+	static std::vector< RingPtr > &getRings() {
+		static std::vector< RingPtr > rings;
+		return rings;
+	}
+	static boost::mutex &getMutex() {
+		static boost::mutex mutex;
+		return mutex;
+	}
+	static volatile bool &getEnabled() {
+		static volatile bool enabled = false;
+		return enabled;
+	}
+	static int &getRingSize() {
+		static int ringSize = DefaultRingSize;
+		return ringSize;
+	}
+};
+
+#ifdef BUFFER_TRACE
+#define BUFFER_TRACE_START(var) int64_t var = BufferTrace::now()
+#define BUFFER_TRACE_SPAN(name, start, id, bytes) BufferTrace::record('X', name, start, id, bytes)
+#define BUFFER_TRACE_INSTANT(name, id, bytes) BufferTrace::record('i', name, 0, id, bytes)
+#define BUFFER_TRACE_ASYNC(phase, name, id, bytes) BufferTrace::record(phase, name, 0, id, bytes)
+#else
+#define BUFFER_TRACE_START(var)
+#define BUFFER_TRACE_SPAN(name, start, id, bytes)
+#define BUFFER_TRACE_INSTANT(name, id, bytes)
+#define BUFFER_TRACE_ASYNC(phase, name, id, bytes)
+#endif
+
+#endif // _BUFFER_TRACE_HPP
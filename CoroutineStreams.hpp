@@ -0,0 +1,343 @@
+// CoroutineStreams.hpp
+
+#ifndef _COROUTINE_STREAMS_HPP
+#define _COROUTINE_STREAMS_HPP
+
+// C++20 awaitables for BufferFifo, BufferPool and marked_istream
+// g++ -std=c++20 ...
+//
+//   BufferFifo::BufferPtr p = co_await asyncPop(fifo);        // NULL at EOF
+//   while (co_await asyncNextRecord(is)) { msg.read(is); }    // false at EOF
+//   BufferPool::BufferPtr b = co_await asyncAcquire(pool, 64);
+//
+// These are plain awaiters, not coroutines: each attempts a non-blocking pop (or underflow, or getBuffer)
+// and, when that fails, registers itself as a BufferWaiter on the fifo or pool and suspends.
+// The pushing (or returning) thread notifies it, which retries the attempt on the
+// CoroutineExecutor it was running on, resuming the coroutine once it succeeds.
+// So no thread blocks while waiting, and awaiting a record does not nest a coroutine frame.
+// Each CoroutineExecutor is single threaded; run one per thread to multiplex
+// many logical streams over a few threads.
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <utility>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "Buffer.hpp"
+#include "marked_iostream.hpp"
+
+class CoroutineExecutor;
+class BufferAwaiter;
+
+template<typename T> class CoroutineTask;
+
+class CoroutineTaskPromiseBase {
+public:
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+			std::coroutine_handle<> continuation = h.promise()._continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { _exception = std::current_exception(); }
+
+	std::coroutine_handle<> _continuation;
+	std::exception_ptr _exception;
+};
+
+template<typename T>
+class CoroutineTaskPromise : public CoroutineTaskPromiseBase {
+public:
+	CoroutineTask<T> get_return_object();
+	void return_value(T value) { _value = std::move(value); }
+	T result() {
+		if (_exception)
+			std::rethrow_exception(_exception);
+		return std::move(_value);
+	}
+	T _value;
+};
+
+template<>
+class CoroutineTaskPromise<void> : public CoroutineTaskPromiseBase {
+public:
+	CoroutineTask<void> get_return_object();
+	void return_void() {}
+	void result() {
+		if (_exception)
+			std::rethrow_exception(_exception);
+	}
+};
+
+// a lazily started coroutine that resumes its awaiter when it completes
+template<typename T = void>
+class CoroutineTask {
+public:
+	typedef CoroutineTaskPromise<T> promise_type;
+	typedef std::coroutine_handle< promise_type > Handle;
+
+	explicit CoroutineTask(Handle h) : _handle(h) {}
+	CoroutineTask(CoroutineTask &&rhs) noexcept : _handle(std::exchange(rhs._handle, nullptr)) {}
+	CoroutineTask(const CoroutineTask &) = delete;
+	CoroutineTask &operator=(const CoroutineTask &) = delete;
+	~CoroutineTask() {
+		if (_handle)
+			_handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+		_handle.promise()._continuation = awaiter;
+		return _handle;
+	}
+	T await_resume() {
+		return _handle.promise().result();
+	}
+
+private:
+	Handle _handle;
+};
+
+template<typename T>
+CoroutineTask<T> CoroutineTaskPromise<T>::get_return_object() {
+	return CoroutineTask<T>( std::coroutine_handle< CoroutineTaskPromise<T> >::from_promise(*this) );
+}
+inline CoroutineTask<void> CoroutineTaskPromise<void>::get_return_object() {
+	return CoroutineTask<void>( std::coroutine_handle< CoroutineTaskPromise<void> >::from_promise(*this) );
+}
+
+// runs scheduled coroutines on the thread calling run().
+// schedule() may be called from any thread.
+class CoroutineExecutor {
+public:
+	CoroutineExecutor() : _live(0), _resumed(0) {}
+	~CoroutineExecutor() {
+		assert(_live == 0);
+	}
+
+	void schedule(std::coroutine_handle<> h) {
+		enqueue( Ready(h, NULL) );
+	}
+	// retry a suspended BufferAwaiter's attempt on this executor's thread
+	void retry(BufferAwaiter *awaiter) {
+		enqueue( Ready(std::coroutine_handle<>(), awaiter) );
+	}
+
+	// start a top level task, owned by this executor until it completes
+	void spawn(CoroutineTask<void> task) {
+		{
+			boost::unique_lock< boost::mutex > l(_mutex);
+			_live++;
+		}
+		detach(std::move(task));
+	}
+
+	// resume scheduled coroutines until every spawned task has completed
+	void run();
+
+	int64_t getResumed() const { return _resumed; }
+	int getLive() const { return _live; }
+
+	// the executor running on this thread, if any
+	static CoroutineExecutor *current() {
+		return getCurrent();
+	}
+
+private:
+	// a coroutine to resume, or an awaiter to retry
+	struct Ready {
+		std::coroutine_handle<> handle;
+		BufferAwaiter *awaiter;
+		Ready(std::coroutine_handle<> h, BufferAwaiter *a) : handle(h), awaiter(a) {}
+	};
+	void enqueue(const Ready &r) {
+		boost::unique_lock< boost::mutex > l(_mutex);
+		_ready.push_back(r);
+		_cond.notify_one();
+	}
+
+	struct Detached {
+		struct promise_type {
+			Detached get_return_object() { return Detached(); }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+	Detached detach(CoroutineTask<void> task) {
+		// start on this executor's thread, not the caller's
+		co_await Reschedule(this);
+		co_await task;
+		boost::unique_lock< boost::mutex > l(_mutex);
+		if (--_live == 0)
+			_cond.notify_all();
+	}
+	struct Reschedule {
+		CoroutineExecutor *_executor;
+		explicit Reschedule(CoroutineExecutor *executor) : _executor(executor) {}
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { _executor->schedule(h); }
+		void await_resume() noexcept {}
+	};
+	static CoroutineExecutor *&getCurrent() {
+		static thread_local CoroutineExecutor *current = NULL;
+		return current;
+	}
+
+private:
+	boost::mutex _mutex;
+	boost::condition_variable _cond;
+	std::deque< Ready > _ready;
+	int _live;
+	int64_t _resumed;
+};
+
+// An attempt (tryReady()) made when awaited and, while it fails, again each time the
+// BufferWaiterList notifies, on the awaiting coroutine's executor.
+// The coroutine is resumed once an attempt succeeds, so spurious wakeups never reach it.
+class BufferAwaiter : public BufferWaiter {
+public:
+	explicit BufferAwaiter(BufferWaiterList &waiters) : _waiters(&waiters), _executor(NULL) {}
+
+	bool await_ready() { return tryReady(); }
+	bool await_suspend(std::coroutine_handle<> h) {
+		_handle = h;
+		_executor = CoroutineExecutor::current();
+		assert(_executor != NULL); // must be awaited within CoroutineExecutor::run()
+		return park();
+	}
+
+	// from the notifying thread
+	void notify() {
+		_executor->retry(this);
+	}
+	// from the executor
+	void retry() {
+		if (!park())
+			_handle.resume();
+	}
+
+protected:
+	// must keep returning true once it has succeeded
+	virtual bool tryReady() = 0;
+
+private:
+	// waits on the list unless the attempt succeeds, returns false to resume the coroutine now
+	bool park() {
+		_waiters->add(this);
+		// re-check to close the race with a notify that preceeded add()
+		if (!tryReady())
+			return true;
+		// a notify that already took this off the list will retry, and resume
+		return !_waiters->remove(this);
+	}
+
+	BufferWaiterList *_waiters;
+	CoroutineExecutor *_executor;
+	std::coroutine_handle<> _handle;
+};
+
+inline void CoroutineExecutor::run() {
+	CoroutineExecutor *previous = getCurrent();
+	getCurrent() = this;
+	boost::unique_lock< boost::mutex > l(_mutex);
+	while (_live > 0 || !_ready.empty()) {
+		if (_ready.empty()) {
+			_cond.wait(l);
+			continue;
+		}
+		Ready r = _ready.front();
+		_ready.pop_front();
+		l.unlock();
+		if (r.awaiter != NULL)
+			r.awaiter->retry();
+		else
+			r.handle.resume();
+		_resumed++;
+		l.lock();
+	}
+	getCurrent() = previous;
+}
+
+// the next Buffer from the fifo, or NULL once it is drained at EOF
+class AsyncPop : public BufferAwaiter {
+public:
+	explicit AsyncPop(BufferFifo &fifo) : BufferAwaiter(fifo.getWaiters()), _fifo(&fifo), _p(NULL) {}
+	BufferFifo::BufferPtr await_resume() { return _p; }
+protected:
+	bool tryReady() {
+		return _p != NULL || _fifo->pop(_p, 0) || _fifo->isEOF();
+	}
+private:
+	BufferFifo *_fifo;
+	BufferFifo::BufferPtr _p;
+};
+inline AsyncPop asyncPop(BufferFifo &fifo) {
+	return AsyncPop(fifo);
+}
+
+// true when the next record can be read from is, false once its fifo is drained at EOF
+class AsyncNextRecord : public BufferAwaiter {
+public:
+	explicit AsyncNextRecord(marked_istream &is)
+		: BufferAwaiter(is.rdbuf()->getBufferFifo().getWaiters()), _is(&is), _done(false), _ready(false) {
+		is.rdbuf()->setReadWait(0);
+	}
+	bool await_resume() { return _ready; }
+protected:
+	bool tryReady() {
+		if (_done)
+			return true;
+		if (_is->isReady()) {
+			_ready = _done = true;
+		} else if (_is->rdbuf()->getBufferFifo().isEOF()) {
+			_ready = _is->isReady();
+			_done = true;
+		}
+		return _done;
+	}
+private:
+	marked_istream *_is;
+	bool _done, _ready;
+};
+inline AsyncNextRecord asyncNextRecord(marked_istream &is) {
+	return AsyncNextRecord(is);
+}
+
+// a Buffer from the pool, allocating while fewer than maxOutstanding exist,
+// otherwise suspending until one is returned
+class AsyncAcquire : public BufferAwaiter {
+public:
+	AsyncAcquire(BufferPool &pool, int64_t maxOutstanding) : BufferAwaiter(pool.getWaiters()), _pool(&pool), _maxOutstanding(maxOutstanding), _p(NULL) {}
+	BufferPool::BufferPtr await_resume() { return _p; }
+protected:
+	bool tryReady() {
+		if (_p == NULL)
+			_p = _pool->getBuffer(0, _pool->getOutstanding() < _maxOutstanding);
+		return _p != NULL;
+	}
+private:
+	BufferPool *_pool;
+	int64_t _maxOutstanding;
+	BufferPool::BufferPtr _p;
+};
+inline AsyncAcquire asyncAcquire(BufferPool &pool, int64_t maxOutstanding) {
+	return AsyncAcquire(pool, maxOutstanding);
+}
+
+#endif // C++20 coroutines
+
+#endif // _COROUTINE_STREAMS_HPP
@@ -0,0 +1,355 @@
+// ExternalSort.hpp
+
+#ifndef _EXTERNAL_SORT_HPP
+#define _EXTERNAL_SORT_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Buffer.hpp"
+#include "marked_iostream.hpp"
+
+// Sorts more records than fit in memory.
+// Producers write records to marked_ostreams on getInput(), calling setMark() after each record,
+// and setEOF() on it when finished.  Each record is the bytes between two marks.
+// Worker threads collect filled Buffers up to their share of the memory budget,
+// sort the records in memory and spill them to a temporary run file.
+// At EOF the runs are merged, fanIn at a time with a loser tree, into getOutput()
+// where they can be read in order with marked_istreams (whose Buffers are record indexed).
+
+class ExternalSort {
+public:
+	typedef Buffer::Size Size;
+	typedef BufferFifo::BufferPtr BufferPtr;
+	// strict weak ordering of two records
+	typedef boost::function< bool (const char *, Size, const char *, Size) > Compare;
+
+	ExternalSort(Compare compare = lexicographic, int64_t memoryBudget = 256 << 20, int fanIn = 64, int threads = 1,
+			Size bufferSize = Buffer::DefaultSize, int numBuffers = 256, const std::string &tmpDir = "/tmp")
+		: _compare(compare), _memoryBudget(memoryBudget), _fanIn(fanIn < 2 ? 2 : fanIn), _threads(threads < 1 ? 1 : threads),
+		  _tmpDir(tmpDir), _input(bufferSize, numBuffers), _output(bufferSize, numBuffers),
+		  _runCount(0), _records(0), _bytes(0), _mergePasses(0), _sortMicroSeconds(0), _mergeMicroSeconds(0), _ok(true) {
+		_input.setRecordIndex(true);
+		_output.setRecordIndex(true);
+	}
+	~ExternalSort() {
+		join();
+		for (size_t i = 0; i < _runs.size(); i++)
+			fclose(_runs[i].file);
+	}
+
+	BufferFifo &getInput() { return _input; }
+	BufferFifo &getOutput() { return _output; }
+
+	// launch the run generating workers and, after the input reaches EOF, the merge
+	void start() {
+		assert(_thread.get() == NULL);
+		for (int i = 0; i < _threads; i++)
+			_workers.create_thread( boost::bind( &ExternalSort::generateRuns, this ) );
+		_thread.reset( new boost::thread( boost::bind( &ExternalSort::merge, this ) ) );
+	}
+	void join() {
+		if (_thread.get() != NULL && _thread->joinable())
+			_thread->join();
+	}
+
+	static bool lexicographic(const char *a, Size aLen, const char *b, Size bLen) {
+		int cmp = memcmp(a, b, std::min(aLen, bLen));
+		return cmp < 0 || (cmp == 0 && aLen < bLen);
+	}
+
+	int64_t getRecords() const { return _records.load(); }
+	int64_t getBytes() const { return _bytes.load(); }
+	int getMergePasses() const { return _mergePasses; }
+	// false if a run file could not be created, written or read back, so records may be missing from the output
+	bool isOk() const { return _ok; }
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "ExternalSort::getState(): records: " << _records.load() << " bytes: " << _bytes.load();
+		ss << " runs: " << _runCount << " mergePasses: " << _mergePasses;
+		ss << " sortTime: " << _sortMicroSeconds.load() << " mergeTime: " << _mergeMicroSeconds << " ok: " << _ok;
+		return ss.str();
+	}
+
+protected:
+	struct Record {
+		const char *data;
+		Size bytes;
+		Record(const char *d, Size b) : data(d), bytes(b) {}
+	};
+	struct RecordLess {
+		const Compare *compare;
+		RecordLess(const Compare *c) : compare(c) {}
+		bool operator()(const Record &a, const Record &b) const {
+			return (*compare)(a.data, a.bytes, b.data, b.bytes);
+		}
+	};
+	// a sorted sequence of length prefixed records in an anonymous temporary file
+	struct Run {
+		FILE *file;
+		int64_t records;
+		Run(FILE *f = NULL, int64_t r = 0) : file(f), records(r) {}
+	};
+
+	// reads one run sequentially for the merge.
+	// A run shorter than its record count ends early, but isOk() turns false
+	class RunReader {
+	public:
+		RunReader(const Run &run) : _file(run.file), _remaining(run.records), _bytes(0), _ok(true) {
+			rewind(_file);
+		}
+		bool next() {
+			if (_remaining <= 0 || !_ok)
+				return false;
+			_remaining--;
+			_ok = fread(&_bytes, sizeof(_bytes), 1, _file) == 1 && _bytes >= 0;
+			if (_ok) {
+				_record.resize(std::max((Size) 1, _bytes));
+				_ok = _bytes == 0 || fread(&_record[0], _bytes, 1, _file) == 1;
+			}
+			return _ok;
+		}
+		const char *data() const { return &_record[0]; }
+		Size bytes() const { return _bytes; }
+		bool isOk() const { return _ok; }
+	private:
+		FILE *_file;
+		int64_t _remaining;
+		Size _bytes;
+		bool _ok;
+		std::vector< char > _record;
+	};
+
+	// Loser tree over k sorted sources: the winner is at _tree[0], internal nodes hold the losers.
+	// Each replacement costs log2(k) comparisons.
+	class LoserTree {
+	public:
+		LoserTree(std::vector< RunReader* > &sources, const Compare &compare)
+			: _sources(sources), _compare(compare), _k(sources.size()), _tree(sources.size(), -1), _live(sources.size()) {
+			for (int i = 0; i < _k; i++)
+				_live[i] = _sources[i]->next();
+			for (int i = 0; i < _k; i++)
+				insert(i);
+		}
+		// the source holding the smallest record, -1 when all are exhausted
+		int top() const {
+			return _k == 0 || !_live[_tree[0]] ? -1 : _tree[0];
+		}
+		// advance the winning source and replay its path
+		void pop() {
+			int winner = _tree[0];
+			_live[winner] = _sources[winner]->next();
+			replay(winner);
+		}
+	private:
+		bool less(int a, int b) const {
+			if (!_live[a]) return false;
+			if (!_live[b]) return true;
+			return _compare(_sources[a]->data(), _sources[a]->bytes(), _sources[b]->data(), _sources[b]->bytes());
+		}
+		// initial build: a source climbs until it finds an empty node
+		void insert(int source) {
+			int winner = source;
+			for (int node = (source + _k) / 2; node > 0; node /= 2) {
+				if (_tree[node] == -1) {
+					_tree[node] = winner;
+					return;
+				}
+				if (less(_tree[node], winner))
+					std::swap(_tree[node], winner);
+			}
+			_tree[0] = winner;
+		}
+		void replay(int source) {
+			int winner = source;
+			for (int node = (source + _k) / 2; node > 0; node /= 2) {
+				if (less(_tree[node], winner))
+					std::swap(_tree[node], winner);
+			}
+			_tree[0] = winner;
+		}
+		std::vector< RunReader* > &_sources;
+		const Compare &_compare;
+		int _k;
+		std::vector< int > _tree;
+		std::vector< bool > _live;
+	};
+
+	FILE *newRunFile() {
+		std::string path = _tmpDir + "/ExternalSort.XXXXXX";
+		std::vector< char > name(path.begin(), path.end());
+		name.push_back('\0');
+		int fd = mkstemp(&name[0]);
+		FILE *f = fd < 0 ? NULL : fdopen(fd, "w+b");
+		if (f == NULL) {
+			LOG("Warning: ExternalSort could not create a run file in " << _tmpDir);
+			_ok = false;
+			return NULL;
+		}
+		unlink(&name[0]); // anonymous, removed on fclose
+		return f;
+	}
+	static bool writeRecord(FILE *f, const char *data, Size bytes) {
+		return fwrite(&bytes, sizeof(Size), 1, f) == 1 && (bytes == 0 || fwrite(data, bytes, 1, f) == 1);
+	}
+	void addRun(FILE *f, int64_t records) {
+		boost::unique_lock< boost::mutex > l(_runMutex);
+		_runs.push_back( Run(f, records) );
+		_runCount++;
+	}
+
+	// worker: batch Buffers up to this thread's share of the memory budget, sort, spill
+	void generateRuns() {
+		int64_t budget = _memoryBudget / _threads;
+		std::vector< BufferPtr > batch;
+		std::vector< Record > records;
+		int64_t batchBytes = 0;
+		while (true) {
+			BufferPtr p = NULL;
+			bool popped = _input.pop(p, 1000);
+			if (popped) {
+				if (!p->isIndexed() && p->size() > 0) {
+					LOG("Warning: ExternalSort received an unindexed Buffer, treating it as one record");
+					records.push_back( Record(p->begin(), p->size()) );
+				}
+				for (Size i = 0; i < p->getRecordCount(); i++)
+					records.push_back( Record(p->begin() + p->getRecordBegin(i), p->getRecordEnd(i) - p->getRecordBegin(i)) );
+				batch.push_back(p);
+				batchBytes += p->capacity();
+			}
+			bool eof = !popped && _input.isEOF();
+			if ((batchBytes >= budget || eof) && !records.empty()) {
+				boost::system_time start = boost::get_system_time();
+				std::sort(records.begin(), records.end(), RecordLess(&_compare));
+				FILE *f = newRunFile();
+				if (f != NULL) {
+					bool written = true;
+					for (size_t i = 0; i < records.size() && written; i++) {
+						written = writeRecord(f, records[i].data, records[i].bytes);
+						_bytes += records[i].bytes;
+					}
+					if (written && fflush(f) == 0) {
+						addRun(f, records.size());
+					} else {
+						LOG("Warning: ExternalSort could not write a run of " << records.size() << " records to " << _tmpDir);
+						_ok = false;
+						fclose(f);
+					}
+				}
+				_records += records.size();
+				records.clear();
+				for (size_t i = 0; i < batch.size(); i++)
+					_input.returnBuffer(batch[i]);
+				batch.clear();
+				batchBytes = 0;
+				_sortMicroSeconds += (boost::get_system_time() - start).total_microseconds();
+			} else if (eof) {
+				for (size_t i = 0; i < batch.size(); i++)
+					_input.returnBuffer(batch[i]);
+				batch.clear();
+			}
+			if (eof)
+				break;
+		}
+	}
+
+	// merge runs[begin, end) with a loser tree, writing records to os or to a new run file.
+	// Clears _ok if a run cannot be read back or out cannot be written
+	int64_t mergeRuns(size_t begin, size_t end, marked_ostream *os, FILE *out) {
+		std::vector< RunReader* > readers;
+		for (size_t i = begin; i < end; i++)
+			readers.push_back( new RunReader(_runs[i]) );
+		LoserTree tree(readers, _compare);
+		int64_t count = 0;
+		bool written = true;
+		int src;
+		while ((src = tree.top()) >= 0 && written) {
+			Size bytes = readers[src]->bytes();
+			if (os != NULL) {
+				os->write(readers[src]->data(), bytes);
+				os->setMark();
+			} else {
+				written = writeRecord(out, readers[src]->data(), bytes);
+			}
+			count++;
+			tree.pop();
+		}
+		if (out != NULL && (!written || fflush(out) != 0)) {
+			LOG("Warning: ExternalSort could not write a merged run to " << _tmpDir);
+			_ok = false;
+		}
+		for (size_t i = 0; i < readers.size(); i++) {
+			if (!readers[i]->isOk()) {
+				LOG("Warning: ExternalSort could not read back run " << begin + i);
+				_ok = false;
+			}
+			delete readers[i];
+		}
+		return count;
+	}
+
+	void merge() {
+		_workers.join_all();
+		boost::system_time start = boost::get_system_time();
+		// intermediate passes until one final merge suffices
+		while ((int) _runs.size() > _fanIn && _ok) {
+			std::vector< Run > next;
+			for (size_t begin = 0; begin < _runs.size(); begin += _fanIn) {
+				size_t end = std::min(_runs.size(), begin + _fanIn);
+				if (end - begin == 1) {
+					next.push_back(_runs[begin]);
+					continue;
+				}
+				FILE *f = newRunFile();
+				if (f == NULL) {
+					// keep the unmerged runs for the final merge, however wide
+					next.insert(next.end(), _runs.begin() + begin, _runs.end());
+					break;
+				}
+				int64_t count = mergeRuns(begin, end, NULL, f);
+				for (size_t i = begin; i < end; i++)
+					fclose(_runs[i].file);
+				next.push_back( Run(f, count) );
+			}
+			_runs.swap(next);
+			_mergePasses++;
+		}
+		{
+			marked_ostream os(_output);
+			mergeRuns(0, _runs.size(), &os, NULL);
+			_mergePasses++;
+		}
+		_mergeMicroSeconds = (boost::get_system_time() - start).total_microseconds();
+		_output.setEOF();
+	}
+
+private:
+	Compare _compare;
+	int64_t _memoryBudget;
+	int _fanIn, _threads;
+	std::string _tmpDir;
+	BufferFifo _input, _output;
+	boost::mutex _runMutex;
+	std::vector< Run > _runs;
+	int _runCount;
+	boost::atomic<int64_t> _records, _bytes;
+	int _mergePasses;
+	boost::atomic<int64_t> _sortMicroSeconds;
+	int64_t _mergeMicroSeconds;
+	volatile bool _ok;
+	boost::thread_group _workers;
+	boost::shared_ptr< boost::thread > _thread;
+};
+
+#endif // _EXTERNAL_SORT_HPP
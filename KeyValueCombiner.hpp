@@ -0,0 +1,130 @@
+// KeyValueCombiner.hpp
+
+#ifndef _KEY_VALUE_COMBINER_HPP
+#define _KEY_VALUE_COMBINER_HPP
+
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/functional/hash.hpp>
+
+#include "Buffer.hpp"
+#include "marked_iostream.hpp"
+
+// Writer side combiner for key/value records that the reader would merge anyway (i.e. sums).
+// add() merges each pair into an open addressing (linear probing) table owned by this writer,
+// and the combined pairs are written to the marked_ostream, one record per pair, only when the
+// table is 3/4 full, or at flush() and destruction.  Skewed keys then cross the BufferFifo once per
+// table fill instead of once per add().
+//
+// Key and Value are written as raw bytes, so both must be plain data (no pointers or std::string).
+// Merge combines two values: merge(existing, added) returns the combined value.
+// Like the stream, a combiner belongs to one writer thread.
+
+template< typename Key, typename Value, typename Merge = std::plus< Value >, typename Hash = boost::hash< Key > >
+class KeyValueCombiner {
+public:
+	const static size_t RecordBytes = sizeof(Key) + sizeof(Value);
+
+	// capacity is rounded up to a power of 2
+	KeyValueCombiner(marked_ostream &os, size_t capacity = 4096, Merge merge = Merge(), Hash hash = Hash())
+		: _os(&os), _merge(merge), _hash(hash), _bits(1), _size(0), _added(0), _emitted(0), _emits(0) {
+		while ((((size_t) 1) << _bits) < capacity)
+			_bits++;
+		_slots.resize(((size_t) 1) << _bits);
+		_mask = _slots.size() - 1;
+		_limit = _slots.size() * 3 / 4;
+	}
+	~KeyValueCombiner() {
+		emit();
+	}
+
+	void add(const Key &key, const Value &value) {
+		_added++;
+		size_t i = index(key);
+		while (_slots[i].used) {
+			if (_slots[i].key == key) {
+				_slots[i].value = _merge(_slots[i].value, value);
+				return;
+			}
+			i = (i + 1) & _mask;
+		}
+		_slots[i].key = key;
+		_slots[i].value = value;
+		_slots[i].used = true;
+		if (++_size >= _limit)
+			emit();
+	}
+
+	// writes every combined pair to the stream and empties the table
+	void emit() {
+		if (_size == 0)
+			return;
+		for (size_t i = 0; i < _slots.size(); i++) {
+			Slot &slot = _slots[i];
+			if (!slot.used)
+				continue;
+			_os->write((const char*) &slot.key, sizeof(Key));
+			_os->write((const char*) &slot.value, sizeof(Value));
+			_os->setMark();
+			slot.used = false;
+		}
+		_emitted += _size;
+		_emits++;
+		_size = 0;
+	}
+	// emits and pushes the stream's Buffer
+	void flush() {
+		emit();
+		_os->setMark(true);
+	}
+
+	// reads one pair written by a combiner, waiting for the next Buffer if needed; false at the end of the stream
+	static bool read(marked_istream &is, Key &key, Value &value) {
+		if (!is.isReady(1000))
+			return false;
+		return is.read((char*) &key, sizeof(Key)) && is.read((char*) &value, sizeof(Value));
+	}
+
+	size_t size() const { return _size; }
+	size_t capacity() const { return _slots.size(); }
+	int64_t getAdded() const { return _added; }
+	int64_t getEmitted() const { return _emitted; }
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "KeyValueCombiner::getState(): added: " << _added << " emitted: " << _emitted << " emits: " << _emits;
+		ss << " size: " << _size << "/" << _slots.size();
+		if (_emitted > 0)
+			ss << " combined: " << (double) _added / _emitted;
+		return ss.str();
+	}
+
+private:
+	struct Slot {
+		Key key;
+		Value value;
+		bool used;
+		Slot() : key(), value(), used(false) {}
+	};
+
+	// Fibonacci hashing spreads the high bits of the product over the table, so identity
+	// hashes of regular (i.e. strided) keys do not cluster
+	size_t index(const Key &key) const {
+		uint64_t h = (uint64_t) _hash(key) * 0x9E3779B97F4A7C15ull;
+		return (size_t) (h >> (64 - _bits));
+	}
+
+	marked_ostream *_os;
+	Merge _merge;
+	Hash _hash;
+	std::vector< Slot > _slots;
+	int _bits;
+	size_t _mask, _limit, _size;
+	int64_t _added, _emitted, _emits;
+};
+
+#endif // _KEY_VALUE_COMBINER_HPP
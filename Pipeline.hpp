@@ -0,0 +1,301 @@
+// Pipeline.hpp
+
+#ifndef _PIPELINE_HPP
+#define _PIPELINE_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "Buffer.hpp"
+#include "marked_iostream.hpp"
+
+// A chain of stages connected by BufferFifos (parse -> transform -> aggregate -> write)
+// Each stage runs its own pool of threads that read from the stage's input fifo
+// and write to the next stage's fifo.
+// EOF propagates down the chain: every stage thread holds a writer registration on the
+// output fifo until its input reaches EOF, and the last one to deregister calls setEOF().
+//
+// Producers write to getInput() (i.e. with marked_ostreams) and call setEOF() on it
+// when they are finished, just as with any other BufferFifo.
+
+class PipelineStage {
+public:
+	typedef BufferFifo::BufferPtr BufferPtr;
+
+	PipelineStage(const std::string &name, BufferFifo &in, BufferFifo *out, int threads, long wait_us = 1000)
+		: _name(name), _in(&in), _out(out), _threads(threads < 1 ? 1 : threads), _wait_us(wait_us),
+		  _busy(0), _wait(0), _items(0), _running(0), _elapsed(0) {}
+	virtual ~PipelineStage() {}
+
+	// registers this stage's writers on the output fifo and launches the threads
+	void start(boost::thread_group &group) {
+		if (_out != NULL) {
+			for (int i = 0; i < _threads; i++)
+				_out->registerWriter();
+		}
+		_running = _threads;
+		_start = boost::get_system_time();
+		for (int i = 0; i < _threads; i++)
+			group.create_thread( boost::bind( &PipelineStage::run, this, i ) );
+	}
+
+	const std::string &getName() const { return _name; }
+	int getThreads() const { return _threads; }
+	int64_t getItems() const { return _items.load(); }
+	int64_t getBusyMicroSeconds() const { return _busy.load(); }
+	int64_t getWaitMicroSeconds() const { return _wait.load(); }
+
+	// fraction of the stage's thread time spent processing rather than waiting on the input fifo
+	double getUtilization() const {
+		int64_t elapsed = _running.load() > 0 ? (boost::get_system_time() - _start).total_microseconds() : _elapsed.load();
+		if (elapsed <= 0)
+			return 0.0;
+		return (double) _busy.load() / ((double) elapsed * _threads);
+	}
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "PipelineStage::getState(): " << _name << " threads: " << _threads << " items: " << _items.load();
+		ss << " busy: " << _busy.load() << " wait: " << _wait.load() << " utilization: " << getUtilization();
+		return ss.str();
+	}
+
+protected:
+	// process the input fifo until it is drained at EOF
+	virtual void process(int threadId) = 0;
+
+	void addTimes(int64_t wait_us, int64_t busy_us, int64_t items) {
+		_wait += wait_us;
+		_busy += busy_us;
+		_items += items;
+	}
+
+	BufferFifo &getInput() { return *_in; }
+	BufferFifo *getOutput() { return _out; }
+	long getWaitTime() const { return _wait_us; }
+
+private:
+	void run(int threadId) {
+		process(threadId);
+		if (--_running == 0)
+			_elapsed = (boost::get_system_time() - _start).total_microseconds();
+		// the last writer of the output fifo signals EOF to the next stage
+		if (_out != NULL && _out->deregisterWriter() == _out->getWriterCount())
+			_out->setEOF();
+	}
+
+private:
+	std::string _name;
+	BufferFifo *_in, *_out;
+	int _threads;
+	long _wait_us;
+	boost::atomic<int64_t> _busy, _wait, _items;
+	boost::atomic<int> _running;
+	boost::atomic<int64_t> _elapsed;
+	boost::system_time _start;
+};
+
+// calls the stage function once per whole Buffer popped from the input fifo.
+// If the function returns true, the (possibly modified in place) Buffer is handed to
+// the output fifo without copying, otherwise it is returned to the input pool.
+// Output that does not fit in place can be written to the marked_ostream (NULL for a sink).
+// When the input fifo is a broadcast subscriber (BufferFifo::subscribe) its Buffers are read-only
+// views shared with the other subscribers: the function must not modify them, and they are forwarded as copies.
+class PipelineBufferStage : public PipelineStage {
+public:
+	typedef boost::function< bool (Buffer &, marked_ostream *) > Function;
+
+	PipelineBufferStage(const std::string &name, Function fn, BufferFifo &in, BufferFifo *out, int threads, long wait_us = 1000)
+		: PipelineStage(name, in, out, threads, wait_us), _fn(fn) {}
+
+protected:
+	void process(int threadId) {
+		BufferFifo &in = getInput();
+		BufferFifo *out = getOutput();
+		boost::scoped_ptr< marked_ostream > os( out == NULL ? NULL : new marked_ostream(*out) );
+		boost::system_time t0 = boost::get_system_time(), t1;
+		while (true) {
+			BufferPtr p = NULL;
+			if (!in.pop(p, getWaitTime())) {
+				if (in.isEOF())
+					break;
+				continue;
+			}
+			t1 = boost::get_system_time();
+			bool forward = _fn(*p, os.get());
+			if (forward && out != NULL && p->isView()) {
+				BufferPtr copy = copyBuffer(*out, *p);
+				in.returnBuffer(p);
+				out->push(copy);
+			} else if (forward && out != NULL) {
+				// exchange a Buffer between the pools so neither grows from the hand-off
+				out->adoptBuffer(p, in);
+				out->push(p);
+			} else {
+				in.returnBuffer(p);
+			}
+			boost::system_time t2 = boost::get_system_time();
+			addTimes((t1 - t0).total_microseconds(), (t2 - t1).total_microseconds(), 1);
+			t0 = t2;
+		}
+	}
+
+	// a Buffer of out holding src's bytes, last mark and record index, read up to where src is
+	static BufferPtr copyBuffer(BufferFifo &out, const Buffer &src) {
+		BufferPtr p = out.getBuffer();
+		p->setIndexed(src.isIndexed());
+		Buffer::Size needed = src.size() + (src.getRecordCount() + 1) * (Buffer::Size) sizeof(Buffer::Size);
+		if (p->capacity() < needed)
+			out.resizeBuffer(p, needed);
+		memcpy(p->begin(), src.begin(), src.size());
+		for (Buffer::Size i = 0; i < src.getRecordCount(); i++) {
+			p->pbump(src.getRecordEnd(i) - p->size());
+			p->setMark();
+		}
+		if (src.getMark() > p->size()) {
+			p->pbump(src.getMark() - p->size());
+			p->setMark();
+		}
+		p->pbump(src.size() - p->size());
+		p->gbump(src.greturned());
+		return p;
+	}
+
+private:
+	Function _fn;
+};
+
+// calls the stage function once per record available on a marked_istream of the input fifo.
+// The function must consume exactly one record and write any output records,
+// each followed by setMark(), to the marked_ostream (NULL for a sink).
+class PipelineRecordStage : public PipelineStage {
+public:
+	typedef boost::function< void (marked_istream &, marked_ostream *) > Function;
+
+	PipelineRecordStage(const std::string &name, Function fn, BufferFifo &in, BufferFifo *out, int threads, long wait_us = 1000)
+		: PipelineStage(name, in, out, threads, wait_us), _fn(fn) {}
+
+protected:
+	void process(int threadId) {
+		BufferFifo &in = getInput();
+		BufferFifo *out = getOutput();
+		marked_istream is(in);
+		boost::scoped_ptr< marked_ostream > os( out == NULL ? NULL : new marked_ostream(*out) );
+		while (true) {
+			boost::system_time t0 = boost::get_system_time();
+			bool ready = is.isReady(getWaitTime());
+			boost::system_time t1 = boost::get_system_time();
+			int64_t items = 0;
+			while (ready && is.isReady()) {
+				_fn(is, os.get());
+				items++;
+			}
+			boost::system_time t2 = boost::get_system_time();
+			addTimes((t1 - t0).total_microseconds(), (t2 - t1).total_microseconds(), items);
+			if (!ready && in.isEOF())
+				break;
+		}
+	}
+
+private:
+	Function _fn;
+};
+
+class Pipeline {
+public:
+	typedef Buffer::Size Size;
+	typedef boost::shared_ptr< BufferFifo > BufferFifoPtr;
+	typedef boost::shared_ptr< PipelineStage > PipelineStagePtr;
+
+	Pipeline(Size bufferSize = Buffer::DefaultSize, int numBuffers = 256)
+		: _bufferSize(bufferSize), _numBuffers(numBuffers), _started(false) {
+		_fifos.push_back( BufferFifoPtr( new BufferFifo(bufferSize, numBuffers) ) );
+	}
+	~Pipeline() {
+		join();
+	}
+
+	// a sink stage has no output fifo and must be the last stage
+	PipelineStage &addBufferStage(const std::string &name, PipelineBufferStage::Function fn, int threads = 1, bool sink = false) {
+		BufferFifo &in = *_fifos.back();
+		BufferFifo *out = addOutput(sink);
+		_stages.push_back( PipelineStagePtr( new PipelineBufferStage(name, fn, in, out, threads) ) );
+		return *_stages.back();
+	}
+	PipelineStage &addRecordStage(const std::string &name, PipelineRecordStage::Function fn, int threads = 1, bool sink = false) {
+		BufferFifo &in = *_fifos.back();
+		BufferFifo *out = addOutput(sink);
+		_stages.push_back( PipelineStagePtr( new PipelineRecordStage(name, fn, in, out, threads) ) );
+		return *_stages.back();
+	}
+
+	// the fifo producers write to
+	BufferFifo &getInput() { return *_fifos.front(); }
+	// the fifo the last (non-sink) stage writes to
+	BufferFifo &getOutput() { return *_fifos.back(); }
+	// the fifo stage i reads from
+	BufferFifo &getFifo(int i) { return *_fifos[i]; }
+	int getFifoCount() const { return _fifos.size(); }
+
+	void start() {
+		assert(!_started);
+		_started = true;
+		for (size_t i = 0; i < _stages.size(); i++)
+			_stages[i]->start(_threads);
+	}
+	void join() {
+		_threads.join_all();
+	}
+
+	int getStageCount() const { return _stages.size(); }
+	const PipelineStage &getStage(int i) const { return *_stages[i]; }
+
+	// the index of the stage with the highest utilization
+	int getBottleneck() const {
+		int worst = -1;
+		double worstUtilization = -1.0;
+		for (size_t i = 0; i < _stages.size(); i++) {
+			double u = _stages[i]->getUtilization();
+			if (u > worstUtilization) {
+				worstUtilization = u;
+				worst = i;
+			}
+		}
+		return worst;
+	}
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "Pipeline::getState(): stages: " << _stages.size() << " bottleneck: " << getBottleneck();
+		for (size_t i = 0; i < _stages.size(); i++)
+			ss << std::endl << "\t" << _stages[i]->getState();
+		return ss.str();
+	}
+
+protected:
+	BufferFifo *addOutput(bool sink) {
+		assert(!_started);
+		assert(_stages.empty() || _fifos.size() > _stages.size()); // nothing may follow a sink
+		if (sink)
+			return NULL;
+		_fifos.push_back( BufferFifoPtr( new BufferFifo(_bufferSize, _numBuffers) ) );
+		return _fifos.back().get();
+	}
+
+private:
+	Size _bufferSize;
+	int _numBuffers;
+	bool _started;
+	std::vector< BufferFifoPtr > _fifos;
+	std::vector< PipelineStagePtr > _stages;
+	boost::thread_group _threads;
+};
+
+#endif // _PIPELINE_HPP
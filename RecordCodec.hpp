@@ -0,0 +1,164 @@
+// RecordCodec.hpp
+
+#ifndef _RECORD_CODEC_HPP
+#define _RECORD_CODEC_HPP
+
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "Buffer.hpp"
+#include "marked_iostream.hpp"
+
+// Compact record framing for the marked streams.
+// Each record is a group-varint header followed by the payload:
+//   one control byte (bits 0-1: payload length bytes - 1, bits 2-3: id bytes - 1),
+//   the payload length and the zigzag encoded id, little endian, in 1 to 4 bytes each.
+// A 16-64 byte record with a small id has a 3 byte header instead of 8 fixed int32 bytes.
+//
+// decodeBuffer() recovers every record boundary of a Buffer at once.
+// With SSSE3 (i.e. -mssse3 or -march=native) each header is decoded with one shuffle
+// selected by its control byte, without per-byte branches.
+
+class RecordCodec {
+public:
+	typedef Buffer::Size Size;
+	const static int MaxHeaderBytes = 9;
+
+	struct Record {
+		const char *data;
+		uint32_t bytes;
+		int32_t id;
+		Record(const char *d = NULL, uint32_t b = 0, int32_t i = 0) : data(d), bytes(b), id(i) {}
+	};
+
+	static int headerBytes(uint32_t bytes, int32_t id) {
+		return 1 + valueBytes(bytes) + valueBytes(zigzag(id));
+	}
+	// returns the header length written to out (at most MaxHeaderBytes)
+	static int encodeHeader(char *out, uint32_t bytes, int32_t id) {
+		uint32_t zid = zigzag(id);
+		int lenBytes = valueBytes(bytes), idBytes = valueBytes(zid);
+		out[0] = (char) ((lenBytes - 1) | ((idBytes - 1) << 2));
+		for (int i = 0; i < lenBytes; i++)
+			out[1 + i] = (char) (bytes >> (8 * i));
+		for (int i = 0; i < idBytes; i++)
+			out[1 + lenBytes + i] = (char) (zid >> (8 * i));
+		return 1 + lenBytes + idBytes;
+	}
+	// returns the header length, 0 if the header is truncated at end
+	static int decodeHeader(const char *p, const char *end, uint32_t &bytes, int32_t &id) {
+		if (p >= end)
+			return 0;
+		uint8_t control = (uint8_t) p[0];
+		int lenBytes = (control & 3) + 1, idBytes = ((control >> 2) & 3) + 1;
+		int header = 1 + lenBytes + idBytes;
+		if (end - p < header)
+			return 0;
+		uint32_t zid;
+#ifdef __SSSE3__
+		if (end - p >= 17) {
+			__m128i v = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*) (p + 1) ), getShuffle(control) );
+			bytes = (uint32_t) _mm_cvtsi128_si32(v);
+			zid = (uint32_t) _mm_cvtsi128_si32( _mm_srli_si128(v, 4) );
+			id = unzigzag(zid);
+			return header;
+		}
+#endif
+		bytes = readValue(p + 1, lenBytes);
+		zid = readValue(p + 1 + lenBytes, idBytes);
+		id = unzigzag(zid);
+		return header;
+	}
+
+	// writes one record and marks it
+	static void writeRecord(marked_ostream &os, int32_t id, const char *data, uint32_t bytes) {
+		char header[MaxHeaderBytes];
+		os.write(header, encodeHeader(header, bytes, id));
+		if (bytes > 0)
+			os.write(data, bytes);
+		os.setMark();
+	}
+	// reads the next record into data, waiting for the next Buffer if needed;
+	// false if the stream has no complete record
+	static bool readRecord(marked_istream &is, int32_t &id, std::vector< char > &data) {
+		char header[MaxHeaderBytes];
+		if (!is.isReady(1000) || !is.read(header, 1))
+			return false;
+		uint8_t control = (uint8_t) header[0];
+		int rest = (control & 3) + 1 + ((control >> 2) & 3) + 1;
+		if (!is.read(header + 1, rest))
+			return false;
+		uint32_t bytes = 0;
+		id = 0;
+		decodeHeader(header, header + 1 + rest, bytes, id);
+		data.resize(bytes);
+		return bytes == 0 || (bool) is.read(&data[0], bytes);
+	}
+
+	// appends every whole record in [begin, end) to records, returning the bytes they span
+	static Size decodeAll(const char *begin, const char *end, std::vector< Record > &records) {
+		const char *p = begin;
+		uint32_t bytes;
+		int32_t id;
+		int header;
+		while ((header = decodeHeader(p, end, bytes, id)) > 0 && end - p - header >= (int64_t) bytes) {
+			records.push_back( Record(p + header, bytes, id) );
+			p += header + bytes;
+		}
+		return p - begin;
+	}
+	// decodes the unread records of a Buffer (i.e. one popped from a BufferFifo) and consumes them
+	static Size decodeBuffer(Buffer &buf, std::vector< Record > &records) {
+		Size consumed = decodeAll(buf.gbegin(), buf.gend(), records);
+		buf.gbump(consumed);
+		return consumed;
+	}
+
+	static uint32_t zigzag(int32_t v) {
+		return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+	}
+	static int32_t unzigzag(uint32_t v) {
+		return (int32_t) ((v >> 1) ^ (~(v & 1) + 1));
+	}
+
+private:
+	static int valueBytes(uint32_t v) {
+		return v < (1u << 8) ? 1 : v < (1u << 16) ? 2 : v < (1u << 24) ? 3 : 4;
+	}
+	static uint32_t readValue(const char *p, int n) {
+		uint32_t v = 0;
+		for (int i = 0; i < n; i++)
+			v |= (uint32_t) (uint8_t) p[i] << (8 * i);
+		return v;
+	}
+
+#ifdef __SSSE3__
+	// moves the length bytes to lane 0 and the id bytes to lane 1, zero filling the rest
+	struct ShuffleTable {
+		__m128i masks[16];
+		ShuffleTable() {
+			for (int control = 0; control < 16; control++) {
+				int lenBytes = (control & 3) + 1, idBytes = ((control >> 2) & 3) + 1;
+				char m[16];
+				memset(m, (char) 0x80, sizeof(m));
+				for (int i = 0; i < lenBytes; i++)
+					m[i] = (char) i;
+				for (int i = 0; i < idBytes; i++)
+					m[4 + i] = (char) (lenBytes + i);
+				masks[control] = _mm_loadu_si128( (const __m128i*) m );
+			}
+		}
+	};
+	static __m128i getShuffle(uint8_t control) {
+		static const ShuffleTable table;
+		return table.masks[control & 15];
+	}
+#endif
+};
+
+#endif // _RECORD_CODEC_HPP
@@ -0,0 +1,206 @@
+// SharedBufferWriter.hpp
+
+#ifndef _SHARED_BUFFER_WRITER_HPP
+#define _SHARED_BUFFER_WRITER_HPP
+
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "Buffer.hpp"
+
+// Write-combining: many writer threads append whole records to one shared active Buffer.
+// A record is placed with an atomic fetch-add on the active Buffer's fill offset (reserve),
+// copied in without locks, and committed.  The writer whose reservation crosses the end of
+// the Buffer seals it and installs the next one; a sealed Buffer is pushed to the BufferFifo
+// once every record in it is committed.  flush() seals a partially filled Buffer.
+//
+// This replaces one mostly empty Buffer per sparse stream with a few shared ones.
+// Records from different writers interleave within a Buffer in reservation order,
+// so they must be self-describing (i.e. RecordCodec framing); Buffers are not record indexed.
+// A record larger than the Buffer size is pushed in a Buffer of its own.
+
+class SharedBufferWriter {
+public:
+	typedef Buffer::Size Size;
+	typedef BufferFifo::BufferPtr BufferPtr;
+	const static int Slots = 8; // Buffers that may be sealed but not yet fully committed
+
+	// a reserved region of the active Buffer, valid until commit()
+	struct Reservation {
+		char *data;
+		Size bytes;
+		int slot;
+		Reservation() : data(NULL), bytes(0), slot(-1) {}
+	};
+
+	SharedBufferWriter(BufferFifo &fifo, int lane = 0)
+		: _fifo(&fifo), _lane(lane), _capacity(fifo.getBufferSize()), _state(0), _records(0), _published(0), _flushed(0), _oversized(0) {
+		for (int i = 0; i < Slots; i++) {
+			_slots[i].buf = NULL;
+			_slots[i].size = 0;
+			_slots[i].commit = 0;
+		}
+		_slots[0].buf = newBuffer();
+		_fifo->registerWriter();
+	}
+	~SharedBufferWriter() {
+		flush();
+		for (int i = 0; i < Slots; i++) {
+			BufferPtr p = _slots[i].buf.exchange(NULL);
+			if (p != NULL)
+				_fifo->returnBuffer(p);
+		}
+		_fifo->deregisterWriter();
+	}
+
+	// reserve bytes in the active Buffer.  Returns false for records larger than a Buffer.
+	bool reserve(Size bytes, Reservation &r) {
+		assert(bytes > 0);
+		if (bytes > _capacity)
+			return false;
+		while (true) {
+			uint64_t state = _state.fetch_add(bytes);
+			uint64_t gen = generation(state), offset = state & OffsetMask;
+			if (offset + bytes <= (uint64_t) _capacity) {
+				// the slot cannot be published before this reservation is committed
+				Slot &slot = _slots[gen % Slots];
+				r.data = slot.buf.load()->begin() + offset;
+				r.bytes = bytes;
+				r.slot = gen % Slots;
+				return true;
+			}
+			if (offset <= (uint64_t) _capacity) {
+				// this reservation crossed the end: seal at offset
+				seal(gen, offset);
+			} else {
+				// another writer is sealing
+				while (generation(_state.load()) == gen)
+					boost::this_thread::yield();
+			}
+		}
+	}
+	void commit(Reservation &r) {
+		Slot &slot = _slots[r.slot];
+		if (slot.commit.fetch_add(r.bytes) + r.bytes == Sealed)
+			publish(slot);
+		_records++;
+		r.data = NULL;
+	}
+
+	// copies one record into the shared Buffer
+	void write(const char *data, Size bytes) {
+		Reservation r;
+		if (reserve(bytes, r)) {
+			memcpy(r.data, data, bytes);
+			commit(r);
+		} else {
+			writeOversized(data, bytes);
+		}
+	}
+
+	// seal the active Buffer if it holds any record, publishing it once its records are committed
+	void flush() {
+		// reserving more than any capacity makes this the sealing writer, unless another one is
+		uint64_t state = _state.fetch_add((uint64_t) FlushBytes);
+		uint64_t gen = generation(state), offset = state & OffsetMask;
+		if (offset <= (uint64_t) _capacity) {
+			seal(gen, offset);
+			if (offset > 0)
+				_flushed++;
+		}
+	}
+
+	BufferFifo &getBufferFifo() { return *_fifo; }
+	int64_t getRecords() const { return _records.load(); }
+	int64_t getPublished() const { return _published.load(); }
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "SharedBufferWriter::getState(): records: " << _records.load() << " published: " << _published.load();
+		ss << " flushed: " << _flushed.load() << " oversized: " << _oversized.load();
+		return ss.str();
+	}
+
+protected:
+	// _state packs the generation of the active Buffer over its fill offset.
+	// Failed reservations and flushes push the offset past the capacity until the seal,
+	// 40 bits leave room for 255 concurrent flushes.
+	const static int OffsetBits = 40;
+	const static uint64_t OffsetMask = (((uint64_t) 1) << OffsetBits) - 1;
+	const static uint64_t FlushBytes = ((uint64_t) 1) << 32;
+	// a slot's commit count reaches Sealed once it is sealed and every reservation is committed
+	const static int64_t Sealed = ((int64_t) 1) << 48;
+
+	struct Slot {
+		boost::atomic< Buffer* > buf;
+		Size size; // set at the seal
+		boost::atomic<int64_t> commit;
+	};
+
+	static uint64_t generation(uint64_t state) {
+		return state >> OffsetBits;
+	}
+
+	BufferPtr newBuffer() {
+		BufferPtr p = _fifo->getBuffer();
+		p->setIndexed(false);
+		// a self-tuning fifo may have shrunk its buffer size
+		if (p->capacity() < _capacity)
+			_fifo->resizeBuffer(p, _capacity);
+		return p;
+	}
+
+	// only the writer whose reservation crossed the end of generation gen calls this
+	void seal(uint64_t gen, uint64_t offset) {
+		Slot &slot = _slots[gen % Slots];
+		Slot &next = _slots[(gen + 1) % Slots];
+		// the next slot's Buffer must have been published
+		while (next.buf.load() != NULL)
+			boost::this_thread::yield();
+		next.commit = 0;
+		slot.size = offset;
+		if (offset == 0) {
+			// nothing to publish, move the Buffer along
+			next.buf = slot.buf.exchange(NULL);
+		} else {
+			next.buf = newBuffer();
+		}
+		_state.store((gen + 1) << OffsetBits);
+		if (offset > 0 && slot.commit.fetch_add(Sealed - (int64_t) offset) + Sealed - (int64_t) offset == Sealed)
+			publish(slot);
+	}
+
+	void publish(Slot &slot) {
+		BufferPtr p = slot.buf.load();
+		p->pbump(slot.size);
+		p->setMark();
+		slot.buf = NULL; // frees the slot for seal()
+		_fifo->push(p, 0, _lane);
+		_published++;
+	}
+
+	void writeOversized(const char *data, Size bytes) {
+		BufferPtr p = _fifo->getBuffer();
+		_fifo->resizeBuffer(p, bytes + 64);
+		p->write(data, bytes);
+		p->setMark();
+		_fifo->push(p, 0, _lane);
+		_oversized++;
+		_records++;
+	}
+
+private:
+	BufferFifo *_fifo;
+	int _lane;
+	Size _capacity; // reservations never exceed the Buffer size at construction
+	boost::atomic<uint64_t> _state;
+	Slot _slots[Slots];
+	boost::atomic<int64_t> _records, _published, _flushed, _oversized;
+};
+
+#endif // _SHARED_BUFFER_WRITER_HPP
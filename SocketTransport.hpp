@@ -0,0 +1,427 @@
+// SocketTransport.hpp
+
+#ifndef _SOCKET_TRANSPORT_HPP
+#define _SOCKET_TRANSPORT_HPP
+
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "Buffer.hpp"
+
+// Moves filled Buffers between a BufferFifo on one node and a BufferFifo on another
+// over a connected TCP or Unix-domain stream socket.
+// Each Buffer is sent as a small frame header followed by its bytes.
+// Headers are in network byte order, so the nodes may differ in endianness.
+// The sender batches several Buffers per writev(), the receiver reads each payload
+// directly into a pool Buffer, picking up as much of the next frame header as has
+// already arrived in the same readv(), but pushes the Buffer as soon as its payload is complete.
+
+class SocketTransport {
+public:
+	typedef Buffer::Size Size;
+
+	// framing header preceeding every Buffer on the wire, big endian
+	struct FrameHeader {
+		uint32_t bytes; // payload bytes, -1 signals EOF
+		uint32_t mark;  // the last mark within the payload
+		void set(Size b, Size m) {
+			bytes = htonl((uint32_t) b);
+			mark = htonl((uint32_t) m);
+		}
+		void setEOF() { set(-1, 0); }
+		Size getBytes() const { return (Size) ntohl(bytes); }
+		Size getMark() const { return (Size) ntohl(mark); }
+		bool isEOF() const { return getBytes() == -1; }
+	};
+
+	// a connected pair of Unix-domain sockets, mostly for loopback testing
+	static bool unixPair(int fds[2]) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+			LOG("Warning: SocketTransport::unixPair() failed: " << strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	// returns a listening socket on port (0 picks an ephemeral port) or -1
+	static int listenOn(int port, int backlog = 16) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			LOG("Warning: SocketTransport::listenOn() socket failed: " << strerror(errno));
+			return -1;
+		}
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port);
+		if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, backlog) != 0) {
+			LOG("Warning: SocketTransport::listenOn(" << port << ") failed: " << strerror(errno));
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	// the port a listening socket is bound to
+	static int getPort(int fd) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(fd, (struct sockaddr*) &addr, &len) != 0)
+			return -1;
+		return ntohs(addr.sin_port);
+	}
+
+	static int acceptFrom(int listenFd) {
+		int fd;
+		while ((fd = accept(listenFd, NULL, NULL)) < 0 && errno == EINTR);
+		if (fd < 0) {
+			LOG("Warning: SocketTransport::acceptFrom() failed: " << strerror(errno));
+			return -1;
+		}
+		setNoDelay(fd);
+		return fd;
+	}
+
+	// returns a socket connected to host:port or -1
+	static int connectTo(const std::string &host, int port) {
+		struct addrinfo hints, *res = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		std::stringstream ss;
+		ss << port;
+		if (getaddrinfo(host.c_str(), ss.str().c_str(), &hints, &res) != 0) {
+			LOG("Warning: SocketTransport::connectTo(" << host << ":" << port << ") could not resolve");
+			return -1;
+		}
+		int fd = -1;
+		for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd < 0)
+				continue;
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+		if (fd < 0) {
+			LOG("Warning: SocketTransport::connectTo(" << host << ":" << port << ") failed: " << strerror(errno));
+			return -1;
+		}
+		setNoDelay(fd);
+		return fd;
+	}
+
+	static void setNoDelay(int fd) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // harmless failure on AF_UNIX
+	}
+
+	// write all iov bytes, advancing iov in place. returns the number of syscalls or -1 on error
+	static int writevFully(int fd, struct iovec *iov, int iovcnt) {
+		int calls = 0;
+		while (iovcnt > 0) {
+			ssize_t n = writev(fd, iov, std::min(iovcnt, (int) IOV_MAX));
+			calls++;
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				LOG("Warning: SocketTransport::writevFully() failed: " << strerror(errno));
+				return -1;
+			}
+			advance(iov, iovcnt, n);
+		}
+		return calls;
+	}
+
+	// read all iov bytes, advancing iov in place. returns the number of syscalls or -1 on error / closed
+	static int readvFully(int fd, struct iovec *iov, int iovcnt) {
+		int calls = 0;
+		while (iovcnt > 0) {
+			ssize_t n = readv(fd, iov, std::min(iovcnt, (int) IOV_MAX));
+			calls++;
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				LOG("Warning: SocketTransport::readvFully() failed: " << strerror(errno));
+				return -1;
+			}
+			if (n == 0) {
+				LOG("Warning: SocketTransport::readvFully() connection closed before EOF frame");
+				return -1;
+			}
+			advance(iov, iovcnt, n);
+		}
+		return calls;
+	}
+
+	// read at least minBytes into iov, and whatever more of iov one readv() already finds,
+	// advancing iov in place.  got is the number of bytes read.
+	// returns the number of syscalls or -1 on error / closed
+	static int readvAtLeast(int fd, struct iovec *&iov, int &iovcnt, size_t minBytes, size_t &got) {
+		int calls = 0;
+		got = 0;
+		while (got < minBytes && iovcnt > 0) {
+			ssize_t n = readv(fd, iov, std::min(iovcnt, (int) IOV_MAX));
+			calls++;
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				LOG("Warning: SocketTransport::readvAtLeast() failed: " << strerror(errno));
+				return -1;
+			}
+			if (n == 0) {
+				LOG("Warning: SocketTransport::readvAtLeast() connection closed before EOF frame");
+				return -1;
+			}
+			got += n;
+			advance(iov, iovcnt, n);
+		}
+		return calls;
+	}
+
+protected:
+	static void advance(struct iovec *&iov, int &iovcnt, ssize_t n) {
+		while (iovcnt > 0 && n >= (ssize_t) iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+};
+
+// drains a BufferFifo onto a connected socket until the fifo reaches EOF
+// then sends the EOF frame.  Buffers are returned to the fifo's pool once sent.
+class BufferFifoSocketSender {
+public:
+	typedef Buffer::Size Size;
+	typedef BufferFifo::BufferPtr BufferPtr;
+	typedef SocketTransport::FrameHeader FrameHeader;
+
+	BufferFifoSocketSender(BufferFifo &bufFifo, int fd, int maxBatch = 16, long wait_us = 1000)
+		: _bufFifo(&bufFifo), _fd(fd), _maxBatch(maxBatch < 1 ? 1 : maxBatch), _wait_us(wait_us),
+		  _sentBuffers(0), _sentBytes(0), _syscalls(0), _ok(true) {}
+	~BufferFifoSocketSender() {
+		join();
+	}
+
+	// send in a background thread
+	void start() {
+		assert(_thread.get() == NULL);
+		_thread.reset( new boost::thread( boost::bind( &BufferFifoSocketSender::run, this ) ) );
+	}
+	void join() {
+		if (_thread.get() != NULL && _thread->joinable())
+			_thread->join();
+	}
+
+	// send in the calling thread. returns false if the socket failed
+	bool run() {
+		std::vector< BufferPtr > batch;
+		std::vector< FrameHeader > headers(_maxBatch);
+		std::vector< struct iovec > iov(2 * _maxBatch);
+		batch.reserve(_maxBatch);
+		while (_ok) {
+			BufferPtr p = NULL;
+			if (!_bufFifo->pop(p, _wait_us)) {
+				if (_bufFifo->isEOF())
+					break;
+				continue;
+			}
+			batch.push_back(p);
+			while ((int) batch.size() < _maxBatch && _bufFifo->pop(p, 0))
+				batch.push_back(p);
+
+			int iovcnt = 0;
+			for (size_t i = 0; i < batch.size(); i++) {
+				Size bytes = batch[i]->size();
+				headers[i].set(bytes, batch[i]->getMark());
+				iov[iovcnt].iov_base = &headers[i];
+				iov[iovcnt++].iov_len = sizeof(FrameHeader);
+				if (bytes > 0) {
+					iov[iovcnt].iov_base = batch[i]->begin();
+					iov[iovcnt++].iov_len = bytes;
+				}
+				_sentBytes += bytes;
+			}
+			int calls = SocketTransport::writevFully(_fd, &iov[0], iovcnt);
+			if (calls < 0)
+				_ok = false;
+			else
+				_syscalls += calls;
+			_sentBuffers += batch.size();
+			for (size_t i = 0; i < batch.size(); i++)
+				_bufFifo->returnBuffer(batch[i]);
+			batch.clear();
+		}
+		if (_ok) {
+			FrameHeader eof;
+			eof.setEOF();
+			struct iovec v;
+			v.iov_base = &eof;
+			v.iov_len = sizeof(eof);
+			if (SocketTransport::writevFully(_fd, &v, 1) < 0)
+				_ok = false;
+		}
+		return _ok;
+	}
+
+	int64_t getSentBuffers() const { return _sentBuffers.load(); }
+	int64_t getSentBytes() const { return _sentBytes.load(); }
+	int64_t getSyscalls() const { return _syscalls.load(); }
+	bool isOk() const { return _ok; }
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "BufferFifoSocketSender::getState(): buffers: " << _sentBuffers.load() << " bytes: " << _sentBytes.load() << " writev: " << _syscalls.load() << " ok: " << _ok;
+		return ss.str();
+	}
+
+private:
+	BufferFifo *_bufFifo;
+	int _fd, _maxBatch;
+	long _wait_us;
+	boost::atomic<int64_t> _sentBuffers, _sentBytes, _syscalls;
+	volatile bool _ok;
+	boost::shared_ptr< boost::thread > _thread;
+};
+
+// reads frames from a connected socket directly into pool Buffers and pushes them
+// into a local BufferFifo for marked_istream consumers.
+// The receiver counts as one writer of the local fifo and, by default, calls setEOF()
+// when the EOF frame arrives and no other writers remain.
+// A connection that fails or closes before the EOF frame, or a corrupt frame (a negative
+// length other than the EOF frame's, a length above maxFrameBytes or a mark past the payload),
+// also ends the stream so readers are not left waiting, but flags the local fifo (BufferFifo::setFailed),
+// so readers can tell the truncated stream from a clean end by BufferFifo::isOk().
+class BufferFifoSocketReceiver {
+public:
+	typedef Buffer::Size Size;
+	typedef BufferFifo::BufferPtr BufferPtr;
+	typedef SocketTransport::FrameHeader FrameHeader;
+
+	BufferFifoSocketReceiver(BufferFifo &bufFifo, int fd, bool setEOFOnClose = true, Size maxFrameBytes = 1 << 30)
+		: _bufFifo(&bufFifo), _fd(fd), _setEOFOnClose(setEOFOnClose), _maxFrameBytes(maxFrameBytes),
+		  _receivedBuffers(0), _receivedBytes(0), _syscalls(0), _ok(true) {}
+	~BufferFifoSocketReceiver() {
+		join();
+	}
+
+	void start() {
+		assert(_thread.get() == NULL);
+		_thread.reset( new boost::thread( boost::bind( &BufferFifoSocketReceiver::run, this ) ) );
+	}
+	void join() {
+		if (_thread.get() != NULL && _thread->joinable())
+			_thread->join();
+	}
+
+	// receive in the calling thread. returns false if the socket failed before the EOF frame
+	bool run() {
+		_bufFifo->registerWriter();
+		FrameHeader hdr, next;
+		size_t hdrBytes = 0; // of hdr already read with the previous payload
+		struct iovec iov[2];
+		while (_ok) {
+			if (hdrBytes < sizeof(hdr)) {
+				iov[0].iov_base = (char*) &hdr + hdrBytes;
+				iov[0].iov_len = sizeof(hdr) - hdrBytes;
+				int calls = SocketTransport::readvFully(_fd, iov, 1);
+				if (calls < 0) {
+					_ok = false;
+					break;
+				}
+				_syscalls += calls;
+			}
+			if (hdr.isEOF())
+				break;
+			Size bytes = hdr.getBytes(), mark = hdr.getMark();
+			if (bytes < 0 || bytes > _maxFrameBytes || mark < 0 || mark > bytes) {
+				LOG("Warning: BufferFifoSocketReceiver received a corrupt frame: " << bytes << " mark " << mark);
+				_ok = false;
+				break;
+			}
+			BufferPtr p = _bufFifo->getBuffer();
+			p->setIndexed(false); // record boundaries are not sent
+			if (p->capacity() < bytes) {
+				_bufFifo->setBufferSize(bytes);
+				_bufFifo->resizeBuffer(p, _bufFifo->getBufferSize());
+			}
+			// the payload and whatever of the following header has arrived with it, but not
+			// waiting for that header, so the last Buffer before a quiet spell is pushed now
+			struct iovec *v = iov;
+			int iovcnt = 2;
+			v[0].iov_base = p->begin();
+			v[0].iov_len = bytes;
+			v[1].iov_base = &next;
+			v[1].iov_len = sizeof(next);
+			size_t got = 0;
+			int calls = SocketTransport::readvAtLeast(_fd, v, iovcnt, bytes, got);
+			if (calls < 0) {
+				_ok = false;
+				_bufFifo->returnBuffer(p);
+				break;
+			}
+			_syscalls += calls;
+			p->pbump(mark);
+			p->setMark();
+			p->pbump(bytes - mark);
+			_receivedBytes += bytes;
+			_receivedBuffers++;
+			_bufFifo->push(p);
+			hdrBytes = got - bytes;
+			memcpy(&hdr, &next, hdrBytes);
+		}
+		if (!_ok)
+			_bufFifo->setFailed();
+		if (_bufFifo->deregisterWriter() == _bufFifo->getWriterCount() && _setEOFOnClose)
+			_bufFifo->setEOF();
+		return _ok;
+	}
+
+	int64_t getReceivedBuffers() const { return _receivedBuffers.load(); }
+	int64_t getReceivedBytes() const { return _receivedBytes.load(); }
+	int64_t getSyscalls() const { return _syscalls.load(); }
+	bool isOk() const { return _ok; }
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "BufferFifoSocketReceiver::getState(): buffers: " << _receivedBuffers.load() << " bytes: " << _receivedBytes.load() << " readv: " << _syscalls.load() << " ok: " << _ok;
+		return ss.str();
+	}
+
+private:
+	BufferFifo *_bufFifo;
+	int _fd;
+	bool _setEOFOnClose;
+	Size _maxFrameBytes;
+	boost::atomic<int64_t> _receivedBuffers, _receivedBytes, _syscalls;
+	volatile bool _ok;
+	boost::shared_ptr< boost::thread > _thread;
+};
+
+#endif // _SOCKET_TRANSPORT_HPP
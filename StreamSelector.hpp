@@ -0,0 +1,230 @@
+// StreamSelector.hpp
+
+#ifndef _STREAM_SELECTOR_HPP
+#define _STREAM_SELECTOR_HPP
+
+#include <vector>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "Buffer.hpp"
+#include "marked_iostream.hpp"
+
+// waits on many marked_istreams at once and returns only the ready ones,
+// instead of scanning every stream with isReady().
+// One selector per reader thread.  The selector is notified by the BufferFifos
+// of its streams on push and EOF, so the cost of select() is proportional to the
+// number of ready streams and fifos, not the number of registered streams.
+// Queued Buffers are handed to idle (exhausted) streams of the same fifo.
+//
+// With useEventFd the selector also signals an eventfd that can be added to an epoll loop,
+// calling select(ready, 0) when it becomes readable.
+//
+// The selector must be destroyed only when no more pushes can reach its fifos.
+
+class StreamSelector {
+public:
+	StreamSelector(bool useEventFd = false) : _signaled(false), _eventFd(-1) {
+#ifdef __linux__
+		if (useEventFd) {
+			_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (_eventFd < 0) {
+				LOG("Warning: StreamSelector could not create an eventfd");
+			}
+		}
+#else
+		if (useEventFd) {
+			LOG("Warning: StreamSelector eventfd is only supported on linux");
+		}
+#endif
+	}
+	~StreamSelector() {
+		for (size_t f = 0; f < _fifos.size(); f++) {
+			if (_fifos[f]->_armed.exchange(false))
+				_fifos[f]->_fifo->getWaiters().remove(_fifos[f].get());
+		}
+#ifdef __linux__
+		if (_eventFd >= 0)
+			close(_eventFd);
+#endif
+	}
+
+	// register a stream, returning its index for select()
+	int add(marked_istream &is) {
+		BufferFifo *fifo = &is.rdbuf()->getBufferFifo();
+		is.rdbuf()->setReadWait(0); // the selector does the waiting
+		size_t f;
+		for (f = 0; f < _fifos.size(); f++)
+			if (_fifos[f]->_fifo == fifo)
+				break;
+		if (f == _fifos.size())
+			_fifos.push_back( FifoEntryPtr( new FifoEntry(this, fifo) ) );
+
+		int idx = _streams.size();
+		_streams.push_back( StreamEntry(&is, f) );
+		if (is.rdbuf()->in_avail() > 0) {
+			_streams[idx]._ready = true;
+			_ready.push_back(idx);
+		} else {
+			_fifos[f]->_idle.push_back(idx);
+		}
+		return idx;
+	}
+
+	marked_istream &getStream(int idx) {
+		return *_streams[idx]._is;
+	}
+	int size() const {
+		return _streams.size();
+	}
+
+	// fills ready with the indexes of streams that can be read without blocking.
+	// waits up to wait_us (negative waits indefinitely) for at least one, or EOF.
+	// Streams returned should be drained (while isReady()) before the next select().
+	int select(std::vector< int > &ready, long wait_us = -1) {
+		boost::system_time deadline = boost::get_system_time() + boost::posix_time::microseconds(wait_us > 0 ? wait_us : 0);
+		while (true) {
+			arm();
+			collect();
+			if (!_ready.empty() || allEOF() || wait_us == 0)
+				break;
+			boost::unique_lock< boost::mutex > l(_mutex);
+			while (!_signaled) {
+				if (wait_us < 0)
+					_cond.wait(l);
+				else if (!_cond.timed_wait(l, deadline))
+					break;
+			}
+			bool timedOut = !_signaled;
+			_signaled = false;
+			if (timedOut) {
+				l.unlock();
+				collect();
+				break;
+			}
+		}
+		drainEventFd();
+		ready = _ready;
+		return ready.size();
+	}
+
+	// every fifo is drained at EOF and no stream has data left
+	bool isEOF() {
+		if (!_ready.empty())
+			return false;
+		collect();
+		return _ready.empty() && allEOF();
+	}
+
+	// readable whenever one of the fifos was pushed to, -1 if not enabled
+	int getEventFd() const {
+		return _eventFd;
+	}
+
+protected:
+	struct StreamEntry {
+		marked_istream *_is;
+		int _fifo;
+		bool _ready;
+		StreamEntry(marked_istream *is, int fifo) : _is(is), _fifo(fifo), _ready(false) {}
+	};
+	class FifoEntry : public BufferWaiter {
+	public:
+		FifoEntry(StreamSelector *selector, BufferFifo *fifo) : _selector(selector), _fifo(fifo), _armed(false) {}
+		void notify() {
+			_armed = false;
+			_selector->signal();
+		}
+		StreamSelector *_selector;
+		BufferFifo *_fifo;
+		boost::atomic<bool> _armed;
+		std::vector< int > _idle; // exhausted streams
+	};
+	typedef boost::shared_ptr< FifoEntry > FifoEntryPtr;
+
+	void signal() {
+		{
+			boost::unique_lock< boost::mutex > l(_mutex);
+			_signaled = true;
+			_cond.notify_one();
+		}
+#ifdef __linux__
+		if (_eventFd >= 0) {
+			uint64_t one = 1;
+			ssize_t ignored = write(_eventFd, &one, sizeof(one));
+			(void) ignored;
+		}
+#endif
+	}
+
+	void drainEventFd() {
+#ifdef __linux__
+		if (_eventFd >= 0) {
+			uint64_t count;
+			ssize_t ignored = read(_eventFd, &count, sizeof(count));
+			(void) ignored;
+		}
+#endif
+	}
+
+	// (re)register for a notification from every fifo, they are one-shot
+	void arm() {
+		for (size_t f = 0; f < _fifos.size(); f++) {
+			if (!_fifos[f]->_armed.exchange(true))
+				_fifos[f]->_fifo->getWaiters().add(_fifos[f].get());
+		}
+	}
+
+	// refresh _ready: keep streams that still have data, hand queued Buffers to idle streams
+	void collect() {
+		size_t keep = 0;
+		for (size_t r = 0; r < _ready.size(); r++) {
+			StreamEntry &s = _streams[_ready[r]];
+			if (s._is->rdbuf()->in_avail() > 0) {
+				_ready[keep++] = _ready[r];
+			} else {
+				s._ready = false;
+				_fifos[s._fifo]->_idle.push_back(_ready[r]);
+			}
+		}
+		_ready.resize(keep);
+		for (size_t f = 0; f < _fifos.size(); f++) {
+			FifoEntry &fe = *_fifos[f];
+			long queued = fe._fifo->getQueueSize();
+			while (queued-- > 0 && !fe._idle.empty()) {
+				int idx = fe._idle.back();
+				if (!_streams[idx]._is->isReady())
+					break; // another reader got it first
+				fe._idle.pop_back();
+				_streams[idx]._ready = true;
+				_ready.push_back(idx);
+			}
+		}
+	}
+
+	bool allEOF() const {
+		for (size_t f = 0; f < _fifos.size(); f++)
+			if (!_fifos[f]->_fifo->isEOF())
+				return false;
+		return true;
+	}
+
+private:
+	std::vector< StreamEntry > _streams;
+	std::vector< FifoEntryPtr > _fifos;
+	std::vector< int > _ready;
+	boost::mutex _mutex;
+	boost::condition_variable _cond;
+	bool _signaled;
+	int _eventFd;
+};
+
+#endif // _STREAM_SELECTOR_HPP
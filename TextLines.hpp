@@ -0,0 +1,114 @@
+// TextLines.hpp
+
+#ifndef _TEXT_LINES_HPP
+#define _TEXT_LINES_HPP
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "Buffer.hpp"
+
+// Newline delimited text over Buffers.
+// A marked_ostream in text mode (see marked_fifo_streambuf::setTextMode) marks at newline
+// boundaries, so every Buffer it pushes holds whole lines.
+// split() finds every newline of a block with SSE2 (or AVX2 with -mavx2 / -march=native),
+// comparing 16 (32) bytes at once and walking the resulting bit mask, instead of per character istream calls.
+
+class TextLines {
+public:
+	typedef Buffer::Size Size;
+
+	// a line without its newline, pointing into the Buffer it was split from
+	struct Line {
+		const char *data;
+		Size bytes;
+		Line(const char *d = NULL, Size b = 0) : data(d), bytes(b) {}
+		std::string str() const { return std::string(data, bytes); }
+	};
+
+	// appends every newline terminated line in [begin, end) to lines, returning the bytes they span.
+	// With final the unterminated trailing bytes are a line too
+	static Size split(const char *begin, const char *end, std::vector< Line > &lines, bool final = false) {
+		const char *lineStart = begin, *p = begin;
+#ifdef __AVX2__
+		const __m256i nl32 = _mm256_set1_epi8('\n');
+		for (; end - p >= 32; p += 32) {
+			uint32_t mask = (uint32_t) _mm256_movemask_epi8( _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*) p ), nl32 ) );
+			while (mask != 0) {
+				const char *nl = p + __builtin_ctz(mask);
+				lines.push_back( Line(lineStart, nl - lineStart) );
+				lineStart = nl + 1;
+				mask &= mask - 1;
+			}
+		}
+#endif
+#ifdef __SSE2__
+		const __m128i nl16 = _mm_set1_epi8('\n');
+		for (; end - p >= 16; p += 16) {
+			uint32_t mask = (uint32_t) _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*) p ), nl16 ) );
+			while (mask != 0) {
+				const char *nl = p + __builtin_ctz(mask);
+				lines.push_back( Line(lineStart, nl - lineStart) );
+				lineStart = nl + 1;
+				mask &= mask - 1;
+			}
+		}
+#endif
+		lineStart = splitScalar(lineStart, p, end, lines);
+		if (final && lineStart < end) {
+			lines.push_back( Line(lineStart, end - lineStart) );
+			lineStart = end;
+		}
+		return lineStart - begin;
+	}
+
+	// splits the unread bytes of a Buffer pushed by a text mode stream and consumes them.
+	// Such Buffers end at a line boundary, so trailing bytes without a newline
+	// (the last line of a stream closed without one) are returned as a line
+	static Size splitBuffer(Buffer &buf, std::vector< Line > &lines) {
+		Size consumed = split(buf.gbegin(), buf.gend(), lines, true);
+		buf.gbump(consumed);
+		return consumed;
+	}
+
+	// one character at a time from p, for the tail of split() and for comparison
+	static const char *splitScalar(const char *lineStart, const char *p, const char *end, std::vector< Line > &lines) {
+		for (; p < end; p++) {
+			if (*p == '\n') {
+				lines.push_back( Line(lineStart, p - lineStart) );
+				lineStart = p + 1;
+			}
+		}
+		return lineStart;
+	}
+
+	// the last newline in [begin, end), NULL if none
+	static const char *findLastNewline(const char *begin, const char *end) {
+		// memrchr is a GNU extension
+		for (const char *p = end; p > begin; p--)
+			if (p[-1] == '\n')
+				return p - 1;
+		return NULL;
+	}
+
+	static const char *getInstructionSet() {
+#if defined(__AVX2__)
+		return "avx2";
+#elif defined(__SSE2__)
+		return "sse2";
+#else
+		return "scalar";
+#endif
+	}
+};
+
+#endif // _TEXT_LINES_HPP
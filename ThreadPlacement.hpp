@@ -0,0 +1,285 @@
+// ThreadPlacement.hpp
+
+#ifndef _THREAD_PLACEMENT_HPP
+#define _THREAD_PLACEMENT_HPP
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <boost/thread/thread.hpp>
+
+#include "Buffer.hpp"
+
+// The cpus of this machine grouped by the L3 cache they share, read from
+// /sys/devices/system/cpu.  Without sysfs every cpu is assumed to share one L3.
+class CpuTopology {
+public:
+	struct Cpu {
+		int cpu, core, package, l3; // l3 is the index of the cache domain in getDomains()
+		Cpu(int c = -1) : cpu(c), core(c), package(0), l3(0) {}
+	};
+	typedef std::vector< int > CpuList;
+
+	CpuTopology(const std::string &sysfs = "/sys/devices/system/cpu") {
+		CpuList online;
+		if (!parseCpuList(readLine(sysfs + "/online"), online)) {
+			for (int i = 0; i < (int) boost::thread::hardware_concurrency(); i++)
+				online.push_back(i);
+			if (online.empty())
+				online.push_back(0);
+			_fromSysfs = false;
+		} else {
+			_fromSysfs = true;
+		}
+		std::map< std::string, int > domainOf;
+		for (size_t i = 0; i < online.size(); i++) {
+			Cpu c(online[i]);
+			std::stringstream dir;
+			dir << sysfs << "/cpu" << c.cpu;
+			readInt(dir.str() + "/topology/core_id", c.core);
+			readInt(dir.str() + "/topology/physical_package_id", c.package);
+			// the cpus sharing the highest level cache identify the domain
+			std::string shared, key;
+			int best = 0;
+			for (int index = 0; index < 8; index++) {
+				std::stringstream cache;
+				cache << dir.str() << "/cache/index" << index;
+				int level = 0;
+				if (!readInt(cache.str() + "/level", level))
+					break;
+				if (level >= best && !(shared = readLine(cache.str() + "/shared_cpu_list")).empty()) {
+					best = level;
+					key = shared;
+				}
+			}
+			if (key.empty()) {
+				std::stringstream pkg;
+				pkg << "package" << c.package;
+				key = pkg.str();
+			}
+			std::map< std::string, int >::iterator it = domainOf.find(key);
+			if (it == domainOf.end()) {
+				it = domainOf.insert( std::make_pair(key, (int) _domains.size()) ).first;
+				_domains.push_back( CpuList() );
+			}
+			c.l3 = it->second;
+			_domains[c.l3].push_back(c.cpu);
+			_cpus.push_back(c);
+		}
+	}
+
+	int getCpuCount() const { return _cpus.size(); }
+	const Cpu &getCpu(int idx) const { return _cpus[idx]; }
+	int getDomainCount() const { return _domains.size(); }
+	const std::vector< CpuList > &getDomains() const { return _domains; }
+	bool isFromSysfs() const { return _fromSysfs; }
+
+	// the L3 domain of a cpu number, -1 if unknown
+	int getDomainOf(int cpu) const {
+		for (size_t i = 0; i < _cpus.size(); i++)
+			if (_cpus[i].cpu == cpu)
+				return _cpus[i].l3;
+		return -1;
+	}
+
+	// every cpu, domain by domain, with one hyperthread per core before any of its siblings
+	CpuList getCompactOrder() const {
+		CpuList order;
+		for (size_t d = 0; d < _domains.size(); d++) {
+			std::set< std::pair<int, int> > cores;
+			CpuList siblings;
+			for (size_t i = 0; i < _cpus.size(); i++) {
+				const Cpu &c = _cpus[i];
+				if (c.l3 != (int) d)
+					continue;
+				if (cores.insert( std::make_pair(c.package, c.core) ).second)
+					order.push_back(c.cpu);
+				else
+					siblings.push_back(c.cpu);
+			}
+			order.insert(order.end(), siblings.begin(), siblings.end());
+		}
+		return order;
+	}
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "CpuTopology::getState(): cpus: " << _cpus.size() << " l3Domains: " << _domains.size() << " fromSysfs: " << _fromSysfs;
+		for (size_t d = 0; d < _domains.size(); d++) {
+			ss << " [";
+			for (size_t i = 0; i < _domains[d].size(); i++)
+				ss << (i ? "," : "") << _domains[d][i];
+			ss << "]";
+		}
+		return ss.str();
+	}
+
+	// parses sysfs cpu lists like "0-3,8,10-11"
+	static bool parseCpuList(const std::string &str, CpuList &cpus) {
+		std::stringstream ss(str);
+		std::string range;
+		bool any = false;
+		while (std::getline(ss, range, ',')) {
+			int first, last;
+			char dash;
+			std::stringstream rs(range);
+			if (!(rs >> first))
+				continue;
+			if (!(rs >> dash >> last))
+				last = first;
+			for (int c = first; c <= last; c++)
+				cpus.push_back(c);
+			any = true;
+		}
+		return any;
+	}
+
+private:
+	static std::string readLine(const std::string &path) {
+		std::ifstream ifs(path.c_str());
+		std::string line;
+		std::getline(ifs, line);
+		return line;
+	}
+	static bool readInt(const std::string &path, int &value) {
+		std::ifstream ifs(path.c_str());
+		return (bool) (ifs >> value);
+	}
+
+	std::vector< Cpu > _cpus;
+	std::vector< CpuList > _domains;
+	bool _fromSysfs;
+};
+
+// Pins reader and writer threads to cpus and assigns streams to them so that the
+// writer and the reader of a stream share an L3 cache when possible.
+// Threads are numbered as in test.cpp: readers 0..readers-1, then writers.
+//
+//   PlacementNone     no pinning, stream i is read by i % readers and written by i % writers
+//   PlacementCompact  readers interleaved with writers, filling one L3 domain (one thread per core first) before the next
+//   PlacementSpread   readers packed from the first domain, writers from the last, so they share as little as possible
+//
+// With one shared BufferFifo for every stream (as in test.cpp), only the pinning takes effect:
+// any reader pops any writer's Buffers, so the stream assignment does not make them L3 local.
+// That needs a BufferFifo per L3 domain, written and read by that domain's threads.
+class ThreadPlacement {
+public:
+	enum Strategy {
+		PlacementNone,
+		PlacementCompact,
+		PlacementSpread
+	};
+
+	ThreadPlacement(const CpuTopology &topology, Strategy strategy, int readers, int writers)
+		: _topology(&topology), _strategy(strategy), _readers(std::max(1, readers)), _writers(std::max(1, writers)) {
+		int threads = _readers + _writers;
+		_cpuOf.assign(threads, -1);
+		_domainOf.assign(threads, -1);
+		CpuTopology::CpuList order = topology.getCompactOrder();
+		if (strategy == PlacementCompact) {
+			int reader = 0, writer = _readers;
+			for (int slot = 0; slot < threads; slot++) {
+				// spread readers evenly between the writers
+				bool isReader = (slot + 1) * _readers / threads > slot * _readers / threads;
+				int thread = isReader ? reader++ : writer++;
+				_cpuOf[thread] = order[slot % order.size()];
+			}
+		} else if (strategy == PlacementSpread) {
+			for (int r = 0; r < _readers; r++)
+				_cpuOf[r] = order[r % order.size()];
+			for (int w = 0; w < _writers; w++)
+				_cpuOf[_readers + w] = order[order.size() - 1 - (w % order.size())];
+		}
+		for (int t = 0; t < threads; t++)
+			_domainOf[t] = _cpuOf[t] < 0 ? -1 : topology.getDomainOf(_cpuOf[t]);
+	}
+
+	Strategy getStrategy() const { return _strategy; }
+	int getCpu(int threadId) const { return _cpuOf[threadId]; }
+
+	// the writer thread of a stream
+	int getWriter(int stream) const {
+		return _readers + stream % _writers;
+	}
+	// the reader thread of a stream, one in the writer's L3 domain when there is one.
+	// With a shared fifo, this only chooses the streams a reader waits on (see above)
+	int getReader(int stream) const {
+		int writer = getWriter(stream);
+		int domain = _domainOf[writer];
+		if (_strategy != PlacementNone && domain >= 0) {
+			std::vector< int > local;
+			for (int r = 0; r < _readers; r++)
+				if (_domainOf[r] == domain)
+					local.push_back(r);
+			if (!local.empty())
+				return local[(stream / _writers) % local.size()];
+		}
+		return stream % _readers;
+	}
+
+	// binds the calling thread to its cpu, or to every cpu with PlacementNone
+	bool pin(int threadId) const {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (_cpuOf[threadId] >= 0) {
+			CPU_SET(_cpuOf[threadId], &set);
+		} else {
+			for (int i = 0; i < _topology->getCpuCount(); i++)
+				CPU_SET(_topology->getCpu(i).cpu, &set);
+		}
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+			LOG("Warning: ThreadPlacement could not pin thread " << threadId << " to cpu " << _cpuOf[threadId]);
+			return false;
+		}
+		return true;
+#else
+		return _cpuOf[threadId] < 0;
+#endif
+	}
+
+	// the fraction of streams assigned a reader in the writer's L3 domain,
+	// not the fraction of Buffers that stay in one domain, unless every domain has its own fifo
+	double getLocalFraction(int streams) const {
+		if (_strategy == PlacementNone || streams <= 0)
+			return 0.0;
+		int local = 0;
+		for (int i = 0; i < streams; i++)
+			local += _domainOf[getReader(i)] == _domainOf[getWriter(i)];
+		return (double) local / streams;
+	}
+
+	static const char *getName(Strategy strategy) {
+		switch (strategy) {
+		case PlacementCompact: return "compact";
+		case PlacementSpread: return "spread";
+		default: return "none";
+		}
+	}
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "ThreadPlacement::getState(): " << getName(_strategy) << " readers: " << _readers << " writers: " << _writers << " cpus:";
+		for (size_t t = 0; t < _cpuOf.size(); t++)
+			ss << " " << (t < (size_t) _readers ? "r" : "w") << t << "@" << _cpuOf[t];
+		return ss.str();
+	}
+
+private:
+	const CpuTopology *_topology;
+	Strategy _strategy;
+	int _readers, _writers;
+	std::vector< int > _cpuOf, _domainOf;
+};
+
+#endif // _THREAD_PLACEMENT_HPP
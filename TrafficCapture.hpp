@@ -0,0 +1,202 @@
+// TrafficCapture.hpp
+
+#ifndef _TRAFFIC_CAPTURE_HPP
+#define _TRAFFIC_CAPTURE_HPP
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "Buffer.hpp"
+
+// Capture of the traffic shape of live marked_ostreams, for replaying it offline
+// (see bench.cpp --bench=replay) against other BufferFifo, pool and buffer size settings.
+// A stream attached with marked_ostream::setCapture() records, at each setMark(), the record size,
+// whether it was a flush, and the microseconds since its previous record.  The payload is not kept.
+//
+// The trace is binary: "PSTRACE1", then chunks of
+//   varint stream, varint events, events * (varint (delta_us << 1 | flush), varint bytes)
+// where the first delta of a stream is from the start of the capture.
+// Each stream buffers its events and appends a chunk every ChunkEvents and when it is destroyed,
+// so chunks of different streams interleave but the events of one stream stay in order.
+
+class TrafficCapture {
+public:
+	typedef Buffer::Size Size;
+	const static int ChunkEvents = 512;
+
+	// one stream's pending events, owned by its marked_fifo_streambuf
+	class Recorder {
+	public:
+		Recorder(TrafficCapture &capture, int stream) : _capture(&capture), _stream(stream), _events(0), _last(0) {}
+		~Recorder() {
+			flush();
+		}
+		void mark(Size bytes, bool flush) {
+			int64_t now = _capture->now();
+			putVarint(_chunk, (uint64_t) (now - _last) << 1 | (flush ? 1 : 0));
+			putVarint(_chunk, bytes);
+			_last = now;
+			if (++_events >= ChunkEvents)
+				this->flush();
+		}
+		void flush() {
+			if (_events > 0)
+				_capture->append(_stream, _events, _chunk);
+			_chunk.clear();
+			_events = 0;
+		}
+	private:
+		TrafficCapture *_capture;
+		int _stream, _events;
+		int64_t _last;
+		std::string _chunk;
+	};
+
+	TrafficCapture(const std::string &path) : _path(path), _out(path.c_str(), std::ios::binary), _start(boost::get_system_time()), _events(0), _bytes(0) {
+		if (!_out) {
+			LOG("Warning: TrafficCapture could not open " << path);
+		}
+		_out.write(getMagic(), 8);
+	}
+
+	// microseconds since the capture started
+	int64_t now() const {
+		return (boost::get_system_time() - _start).total_microseconds();
+	}
+
+	void append(int stream, int events, const std::string &chunk) {
+		std::string header;
+		putVarint(header, stream);
+		putVarint(header, events);
+		boost::unique_lock< boost::mutex > l(_mutex);
+		_out.write(header.data(), header.size());
+		_out.write(chunk.data(), chunk.size());
+		_events += events;
+		_bytes += header.size() + chunk.size();
+	}
+	void flush() {
+		boost::unique_lock< boost::mutex > l(_mutex);
+		_out.flush();
+	}
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "TrafficCapture::getState(): " << _path << " events: " << _events.load() << " bytes: " << _bytes.load();
+		return ss.str();
+	}
+
+	static void putVarint(std::string &out, uint64_t v) {
+		while (v >= 0x80) {
+			out += (char) (v | 0x80);
+			v >>= 7;
+		}
+		out += (char) v;
+	}
+	static bool getVarint(std::istream &in, uint64_t &v) {
+		v = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			int c = in.get();
+			if (c == EOF)
+				return false;
+			v |= (uint64_t) (c & 0x7f) << shift;
+			if ((c & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	static const char *getMagic() {
+		return "PSTRACE1";
+	}
+
+private:
+	std::string _path;
+	std::ofstream _out;
+	boost::mutex _mutex;
+	boost::system_time _start;
+	boost::atomic<int64_t> _events, _bytes;
+};
+
+// A loaded trace: the records of every captured stream, at microseconds since the capture started
+class TrafficTrace {
+public:
+	typedef Buffer::Size Size;
+	struct Record {
+		int64_t time_us;
+		Size bytes;
+		bool flush;
+		Record(int64_t t = 0, Size b = 0, bool f = false) : time_us(t), bytes(b), flush(f) {}
+	};
+	typedef std::vector< Record > Records;
+
+	TrafficTrace() : _records(0), _bytes(0), _duration(0) {}
+
+	bool load(const std::string &path) {
+		std::ifstream in(path.c_str(), std::ios::binary);
+		char magic[8];
+		if (!in.read(magic, 8) || memcmp(magic, TrafficCapture::getMagic(), 8) != 0) {
+			LOG("Warning: " << path << " is not a TrafficCapture trace");
+			return false;
+		}
+		std::map< int, size_t > indexOf;
+		std::vector< int64_t > times;
+		uint64_t stream, events, delta, bytes;
+		while (TrafficCapture::getVarint(in, stream)) {
+			if (!TrafficCapture::getVarint(in, events))
+				return truncated(path);
+			std::map< int, size_t >::iterator it = indexOf.find((int) stream);
+			if (it == indexOf.end()) {
+				it = indexOf.insert( std::make_pair((int) stream, _streams.size()) ).first;
+				_streams.push_back( Records() );
+				_ids.push_back((int) stream);
+				times.push_back(0);
+			}
+			Records &records = _streams[it->second];
+			int64_t &time = times[it->second];
+			for (uint64_t e = 0; e < events; e++) {
+				if (!TrafficCapture::getVarint(in, delta) || !TrafficCapture::getVarint(in, bytes))
+					return truncated(path);
+				time += delta >> 1;
+				records.push_back( Record(time, (Size) bytes, (delta & 1) != 0) );
+				_records++;
+				_bytes += bytes;
+				_duration = std::max(_duration, time);
+			}
+		}
+		return true;
+	}
+
+	int getStreamCount() const { return _streams.size(); }
+	int getStreamId(int i) const { return _ids[i]; }
+	const Records &getRecords(int i) const { return _streams[i]; }
+	int64_t getRecordCount() const { return _records; }
+	int64_t getBytes() const { return _bytes; }
+	int64_t getDuration() const { return _duration; }
+
+	std::string getState() const {
+		std::stringstream ss;
+		ss << "TrafficTrace::getState(): streams: " << _streams.size() << " records: " << _records << " bytes: " << _bytes << " duration: " << _duration << "us";
+		return ss.str();
+	}
+
+private:
+	bool truncated(const std::string &path) {
+		LOG("Warning: " << path << " is truncated after " << _records << " records");
+		return false;
+	}
+
+	std::vector< Records > _streams;
+	std::vector< int > _ids;
+	int64_t _records, _bytes, _duration;
+};
+
+#endif // _TRAFFIC_CAPTURE_HPP
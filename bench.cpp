@@ -0,0 +1,712 @@
+// module load boost/1.53.0
+// g++ -Wall -O3 -I $BOOST_DIR/include -L $BOOST_DIR/lib bench.cpp -lboost_system -lboost_thread
+//
+// Benchmark suite with machine readable output, for tracking regressions between releases.
+//
+//   queue   BoundedQueue vs boost::lockfree::queue push/pop of pointers
+//   fifo    BufferFifo push/pop of Buffers
+//   pool    BufferPool getBuffer/returnBuffer
+//   stream  end to end marked_ostream -> marked_istream throughput and per-message latency
+//   lines   newline splitting of text: TextLines SIMD split vs one character at a time vs std::getline
+//   replay  the streams of a TrafficCapture trace (i.e. from stream --capture) re-driven through a BufferFifo;
+//           p50us/p99us are then how far the writers fell behind the captured schedule
+//
+// bench [--name=value ...]
+//   --bench=queue,fifo,pool,stream   which benchmarks to run (lines and replay are not run by default)
+//   --threads=1,2,4                  thread counts to sweep (half writers, half readers)
+//   --dist=fixed,uniform,exponential message size distributions to sweep (stream)
+//   --size=32                        mean message payload (stream) or line (lines) bytes
+//   --placement=none                 ThreadPlacement strategies to sweep: none,compact,spread (stream)
+//   --ops=200000                     operations per producer thread (queue, fifo, pool), lines of text (lines)
+//   --messages=200000                messages per writer thread (stream)
+//   --bufferSize=8192 --numBuffers=256
+//   --trace=file                     the trace to replay (replay)
+//   --speed=1                        replay at the captured times, 2 is twice as fast, 0 as fast as possible (replay)
+//   --maxDelay=0 --autoTune=0        BufferFifo::setMaxDelay() and setAutoTune() (stream, replay)
+//   --shared=0                       1: the writers combine their messages in shared Buffers, see SharedBufferWriter (stream)
+//   --capture=file                   record the writers' traffic for --bench=replay, see TrafficCapture (stream)
+//   --transport=fifo                 fifo, or bridge the writers' fifo to the readers' over a unix socketpair or tcp loopback (stream)
+//   --maxInFlight=0                  BufferFifo::setCreditLimit() on the writers' fifo, 0 is unlimited (stream)
+//   --readAhead=0                    Buffers each reader keeps popped ahead, see marked_istream::setReadAhead() (stream)
+//   --warmup=1 --repeat=3            unreported and reported runs of every configuration
+//   --format=csv|json --output=-     results to a file, - for stdout
+// Progress and a median summary go to stderr.
+
+#include "Buffer.hpp"
+#include "BoundedQueue.hpp"
+#include "marked_iostream.hpp"
+#include "SharedBufferWriter.hpp"
+#include "SocketTransport.hpp"
+#include "ThreadPlacement.hpp"
+#include "TextLines.hpp"
+#include "TrafficCapture.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/random/exponential_distribution.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using namespace std;
+
+typedef Buffer* BufferPtr;
+
+class Params {
+public:
+	Params(int argc, char *argv[]) {
+		for (int i = 1; i < argc; i++) {
+			string arg(argv[i]);
+			size_t eq = arg.find('=');
+			if (arg.compare(0, 2, "--") != 0 || eq == string::npos) {
+				LOG("Warning: ignoring argument " << arg << ", expected --name=value");
+				continue;
+			}
+			_values[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+		}
+	}
+	string get(const string &name, const string &def) const {
+		map< string, string >::const_iterator it = _values.find(name);
+		return it == _values.end() ? def : it->second;
+	}
+	int64_t getInt(const string &name, int64_t def) const {
+		map< string, string >::const_iterator it = _values.find(name);
+		return it == _values.end() ? def : atol(it->second.c_str());
+	}
+	vector< string > getList(const string &name, const string &def) const {
+		vector< string > list;
+		stringstream ss(get(name, def));
+		string item;
+		while (getline(ss, item, ','))
+			if (!item.empty())
+				list.push_back(item);
+		return list;
+	}
+private:
+	map< string, string > _values;
+};
+
+struct Result {
+	string bench, variant, dist, placement;
+	int threads, size, repeat;
+	double seconds, opsPerSec, mbPerSec, p50us, p99us;
+	Result() : threads(0), size(0), repeat(0), seconds(0), opsPerSec(0), mbPerSec(0), p50us(0), p99us(0) {}
+};
+
+class Report {
+public:
+	Report(const string &format) : _json(format == "json") {}
+	void add(const Result &r) {
+		_results.push_back(r);
+	}
+	void write(ostream &os) const {
+		if (_json) {
+			os << "[";
+			for (size_t i = 0; i < _results.size(); i++) {
+				const Result &r = _results[i];
+				os << (i ? ",\n" : "\n") << "{\"bench\":\"" << r.bench << "\",\"variant\":\"" << r.variant << "\",\"dist\":\"" << r.dist
+				   << "\",\"placement\":\"" << r.placement << "\",\"threads\":" << r.threads << ",\"size\":" << r.size << ",\"repeat\":" << r.repeat
+				   << ",\"seconds\":" << r.seconds << ",\"opsPerSec\":" << r.opsPerSec << ",\"mbPerSec\":" << r.mbPerSec
+				   << ",\"p50us\":" << r.p50us << ",\"p99us\":" << r.p99us << "}";
+			}
+			os << "\n]" << endl;
+		} else {
+			os << "bench,variant,dist,placement,threads,size,repeat,seconds,opsPerSec,mbPerSec,p50us,p99us" << endl;
+			for (size_t i = 0; i < _results.size(); i++) {
+				const Result &r = _results[i];
+				os << r.bench << "," << r.variant << "," << r.dist << "," << r.placement << "," << r.threads << "," << r.size << "," << r.repeat
+				   << "," << r.seconds << "," << r.opsPerSec << "," << r.mbPerSec << "," << r.p50us << "," << r.p99us << endl;
+			}
+		}
+	}
+	// median opsPerSec of the repeats of every configuration
+	void summarize() const {
+		map< string, vector< double > > runs;
+		vector< string > order;
+		for (size_t i = 0; i < _results.size(); i++) {
+			const Result &r = _results[i];
+			stringstream key;
+			key << r.bench << " " << r.variant << " " << r.dist << " " << r.placement << " threads: " << r.threads;
+			if (runs.find(key.str()) == runs.end())
+				order.push_back(key.str());
+			runs[key.str()].push_back(r.opsPerSec);
+		}
+		for (size_t i = 0; i < order.size(); i++) {
+			vector< double > &v = runs[order[i]];
+			sort(v.begin(), v.end());
+			LOG(order[i] << " median: " << (v[v.size() / 2] / 1000000.0) << " Mops/s");
+		}
+	}
+private:
+	bool _json;
+	vector< Result > _results;
+};
+
+static int64_t nowNanos() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void splitThreads(int threads, int &producers, int &consumers) {
+	producers = threads > 1 ? threads / 2 : 1;
+	consumers = threads > 1 ? threads - producers : 1;
+}
+
+// queue: pointers through BoundedQueue or boost::lockfree::queue
+
+template< typename Q >
+void queueProduce(Q *q, int64_t ops) {
+	for (int64_t i = 1; i <= ops; i++) {
+		BufferPtr p = (BufferPtr) i;
+		while (!q->push(p))
+			boost::this_thread::yield();
+	}
+}
+template< typename Q >
+void queueConsume(Q *q, boost::atomic<int64_t> *remaining) {
+	BufferPtr p = NULL;
+	while (remaining->load() > 0) {
+		if (q->pop(p))
+			(*remaining)--;
+		else
+			boost::this_thread::yield();
+	}
+}
+template< typename Q >
+double runQueue(int threads, int64_t ops, int capacity) {
+	Q q(capacity);
+	int producers, consumers;
+	splitThreads(threads, producers, consumers);
+	boost::atomic<int64_t> remaining(ops * producers);
+	int64_t start = nowNanos();
+	boost::thread_group group;
+	for (int i = 0; i < consumers; i++)
+		group.create_thread( boost::bind( &queueConsume<Q>, &q, &remaining ) );
+	for (int i = 0; i < producers; i++)
+		group.create_thread( boost::bind( &queueProduce<Q>, &q, ops ) );
+	group.join_all();
+	return (nowNanos() - start) / 1e9;
+}
+
+// fifo: Buffers from getBuffer() pushed and popped, returned by the consumer
+
+void fifoProduce(BufferFifo *fifo, int64_t ops) {
+	for (int64_t i = 0; i < ops; i++) {
+		BufferPtr p = fifo->getBuffer();
+		p->write((const char*) &i, sizeof(i));
+		fifo->push(p);
+	}
+}
+// until the fifo is drained at EOF
+void fifoConsume(BufferFifo *fifo) {
+	BufferPtr p = NULL;
+	while (true) {
+		if (fifo->pop(p, 1000)) {
+			fifo->returnBuffer(p);
+			p = NULL;
+		} else if (fifo->isEOF()) {
+			break;
+		}
+	}
+}
+double runFifo(int threads, int64_t ops, int bufferSize, int numBuffers) {
+	BufferFifo fifo(bufferSize, numBuffers);
+	int producers, consumers;
+	splitThreads(threads, producers, consumers);
+	int64_t start = nowNanos();
+	boost::thread_group consumerGroup, producerGroup;
+	for (int i = 0; i < consumers; i++)
+		consumerGroup.create_thread( boost::bind( &fifoConsume, &fifo ) );
+	for (int i = 0; i < producers; i++)
+		producerGroup.create_thread( boost::bind( &fifoProduce, &fifo, ops ) );
+	producerGroup.join_all();
+	fifo.setEOF();
+	consumerGroup.join_all();
+	return (nowNanos() - start) / 1e9;
+}
+
+// pool: every thread takes and returns a few Buffers at a time
+
+void poolCycle(BufferPool *pool, int64_t ops) {
+	BufferPtr held[4];
+	for (int64_t i = 0; i < ops; i += 4) {
+		for (int j = 0; j < 4; j++)
+			held[j] = pool->getBuffer();
+		for (int j = 0; j < 4; j++)
+			pool->returnBuffer(held[j]);
+	}
+}
+double runPool(int threads, int64_t ops, int bufferSize, int numBuffers) {
+	BufferPool pool(numBuffers, bufferSize);
+	int64_t start = nowNanos();
+	boost::thread_group group;
+	for (int i = 0; i < threads; i++)
+		group.create_thread( boost::bind( &poolCycle, &pool, ops ) );
+	group.join_all();
+	return (nowNanos() - start) / 1e9;
+}
+
+// lines: every thread splits the same text, a Buffer at a time as a text mode stream would push it
+
+void linesSplit(const string *text, const string *variant, int bufferSize, boost::atomic<int64_t> *count) {
+	int64_t lines = 0;
+	if (*variant == "getline") {
+		istringstream iss(*text);
+		string line;
+		while (getline(iss, line))
+			lines++;
+	} else {
+		vector< TextLines::Line > found;
+		const char *p = text->data(), *end = p + text->size();
+		while (p < end) {
+			const char *blockEnd = std::min(p + bufferSize, end);
+			found.clear();
+			if (*variant == "scalar")
+				p = TextLines::splitScalar(p, p, blockEnd, found);
+			else
+				p += TextLines::split(p, blockEnd, found, blockEnd == end);
+			if (found.empty())
+				p = blockEnd; // a line longer than the block
+			lines += found.size();
+		}
+	}
+	*count += lines;
+}
+double runLines(Result &r, int threads, const string &variant, int64_t lines, int size, int bufferSize) {
+	boost::random::mt19937 rng(1);
+	boost::random::uniform_int_distribution<int32_t> bytes(1, 2 * size - 1), letter('a', 'z');
+	string text;
+	for (int64_t i = 0; i < lines; i++) {
+		int32_t n = bytes(rng);
+		for (int32_t j = 0; j < n; j++)
+			text += (char) letter(rng);
+		text += '\n';
+	}
+	boost::atomic<int64_t> count(0);
+	int64_t start = nowNanos();
+	boost::thread_group group;
+	for (int i = 0; i < threads; i++)
+		group.create_thread( boost::bind( &linesSplit, &text, &variant, bufferSize, &count ) );
+	group.join_all();
+	double secs = (nowNanos() - start) / 1e9;
+	if (count.load() != lines * threads) {
+		LOG("Warning: lines split " << count.load() << " of " << lines * threads << " lines");
+	}
+	r.mbPerSec = (double) text.size() * threads / 1000000.0 / secs;
+	return secs;
+}
+
+// stream: messages of int32 payload bytes, int64 send time, payload
+
+struct StreamOptions {
+	long maxDelay;
+	bool autoTune, shared;
+	TrafficCapture *capture; // NULL records nothing
+	int captureBase; // the stream id of the first writer
+	string transport; // fifo, unix or tcp
+	int maxInFlight, readAhead;
+	StreamOptions() : maxDelay(0), autoTune(false), shared(false), capture(NULL), captureBase(0), transport("fifo"), maxInFlight(0), readAhead(0) {}
+};
+
+// a connected socket pair for the transport, fds[0] sends.  false if it could not connect
+static bool connectTransport(const string &transport, int fds[2]) {
+	if (transport == "unix")
+		return SocketTransport::unixPair(fds);
+	int listenFd = SocketTransport::listenOn(0);
+	if (listenFd < 0)
+		return false;
+	fds[0] = SocketTransport::connectTo("127.0.0.1", SocketTransport::getPort(listenFd));
+	fds[1] = fds[0] < 0 ? -1 : SocketTransport::acceptFrom(listenFd);
+	close(listenFd);
+	if (fds[1] < 0 && fds[0] >= 0)
+		close(fds[0]);
+	return fds[1] >= 0;
+}
+
+struct StreamRun {
+	BufferFifo *fifo, *readFifo; // readFifo is the far end of the socket, or fifo
+	boost::shared_ptr< SharedBufferWriter > shared; // the last writer destroys it
+	const StreamOptions *options;
+	const ThreadPlacement *placement;
+	string dist;
+	int size;
+	int64_t messages;
+	boost::atomic<int64_t> bytes;
+	boost::atomic<int> activeWriters;
+	boost::mutex mutex;
+	vector< int64_t > latencies;
+	StreamRun() : bytes(0), activeWriters(0) {}
+};
+
+void streamWrite(StreamRun *run, int threadId, int writer) {
+	run->placement->pin(threadId);
+	boost::random::mt19937 rng; rng.seed(threadId + 1);
+	boost::random::uniform_int_distribution<int32_t> uniform(1, 2 * run->size - 1);
+	boost::random::exponential_distribution<> exponential(1.0 / run->size);
+	vector< char > payload(64 * run->size + 64, 'x');
+	int64_t bytes = 0;
+	{
+		marked_ostream_ptr out( run->shared.get() != NULL ? new marked_ostream(*run->shared) : new marked_ostream(*run->fifo) );
+		marked_ostream &os = *out;
+		os.setCapture(run->options->capture, run->options->captureBase + writer);
+		for (int64_t i = 0; i < run->messages; i++) {
+			int32_t n = run->size;
+			if (run->dist == "uniform")
+				n = uniform(rng);
+			else if (run->dist == "exponential")
+				n = std::min((int32_t) payload.size(), 1 + (int32_t) exponential(rng));
+			int64_t sent = nowNanos();
+			os.write((const char*) &n, sizeof(n));
+			os.write((const char*) &sent, sizeof(sent));
+			os.write(&payload[0], n);
+			os.setMark();
+			bytes += n + sizeof(n) + sizeof(sent);
+		}
+	}
+	run->bytes += bytes;
+	if (--run->activeWriters == 0) {
+		run->shared.reset(); // publishes the last shared Buffer
+		run->fifo->setEOF();
+	}
+}
+void streamRead(StreamRun *run, int threadId) {
+	run->placement->pin(threadId);
+	vector< int64_t > latencies;
+	vector< char > payload(64 * run->size + 64);
+	{
+		marked_istream is(*run->readFifo);
+		is.setReadAhead(run->options->readAhead);
+		int32_t n;
+		int64_t sent;
+		while (is.isReady(1000) || !run->readFifo->isEOF()) {
+			while (is.isReady()) {
+				is.read((char*) &n, sizeof(n));
+				is.read((char*) &sent, sizeof(sent));
+				is.read(&payload[0], n);
+				latencies.push_back(nowNanos() - sent);
+			}
+		}
+	}
+	boost::unique_lock< boost::mutex > l(run->mutex);
+	run->latencies.insert(run->latencies.end(), latencies.begin(), latencies.end());
+}
+double runStream(Result &r, int threads, const CpuTopology &topology, ThreadPlacement::Strategy strategy, int64_t messages, int bufferSize, int numBuffers, const StreamOptions &options) {
+	int writers, readers;
+	splitThreads(threads, writers, readers);
+	BufferFifo fifo(bufferSize, numBuffers), far(bufferSize, numBuffers);
+	fifo.setMaxDelay(options.maxDelay);
+	fifo.setAutoTune(options.autoTune);
+	fifo.setCreditLimit(options.maxInFlight);
+	ThreadPlacement placement(topology, strategy, readers, writers);
+	StreamRun run;
+	run.fifo = &fifo;
+	run.readFifo = &fifo;
+	// optionally the writers' fifo is sent over a loopback socket to the readers' fifo
+	int fds[2] = {-1, -1};
+	boost::shared_ptr< BufferFifoSocketSender > sender;
+	boost::shared_ptr< BufferFifoSocketReceiver > receiver;
+	if (options.transport != "fifo") {
+		if (!connectTransport(options.transport, fds)) {
+			LOG("Warning: stream could not connect a " << options.transport << " socket, using the fifo");
+		} else {
+			run.readFifo = &far;
+			sender.reset( new BufferFifoSocketSender(fifo, fds[0]) );
+			receiver.reset( new BufferFifoSocketReceiver(far, fds[1]) );
+			sender->start();
+			receiver->start();
+		}
+	}
+	if (options.shared)
+		run.shared.reset( new SharedBufferWriter(fifo) );
+	run.options = &options;
+	run.placement = &placement;
+	run.dist = r.dist;
+	run.size = r.size;
+	run.messages = messages;
+	run.activeWriters = writers;
+	int64_t start = nowNanos();
+	boost::thread_group group;
+	for (int i = 0; i < readers; i++)
+		group.create_thread( boost::bind( &streamRead, &run, i ) );
+	for (int i = 0; i < writers; i++)
+		group.create_thread( boost::bind( &streamWrite, &run, readers + i, i ) );
+	group.join_all();
+	double secs = (nowNanos() - start) / 1e9;
+	if (sender.get() != NULL) {
+		sender->join();
+		receiver->join();
+		LOG(sender->getState());
+		LOG(receiver->getState());
+		close(fds[0]);
+		close(fds[1]);
+	}
+	if ((int64_t) run.latencies.size() != messages * writers) {
+		LOG("Warning: stream read " << run.latencies.size() << " of " << messages * writers << " messages");
+	}
+	sort(run.latencies.begin(), run.latencies.end());
+	if (!run.latencies.empty()) {
+		r.p50us = run.latencies[run.latencies.size() / 2] / 1000.0;
+		r.p99us = run.latencies[run.latencies.size() * 99 / 100] / 1000.0;
+	}
+	r.mbPerSec = run.bytes.load() / 1000000.0 / secs;
+	return secs;
+}
+
+// replay: each writer re-drives every writers-th stream of the trace, reading discards the bytes
+
+struct ReplayRun {
+	BufferFifo *fifo;
+	const TrafficTrace *trace;
+	double speed;
+	int writers;
+	boost::atomic<int64_t> bytes;
+	boost::atomic<int> activeWriters;
+	boost::mutex mutex;
+	vector< int64_t > lateness;
+	ReplayRun() : bytes(0), activeWriters(0) {}
+};
+
+struct ReplayEvent {
+	int64_t time_us;
+	int stream;
+	TrafficTrace::Size bytes;
+	bool flush;
+	bool operator<(const ReplayEvent &rhs) const { return time_us < rhs.time_us; }
+};
+
+void replayWrite(ReplayRun *run, int writer) {
+	const TrafficTrace &trace = *run->trace;
+	vector< marked_ostream_ptr > os;
+	vector< ReplayEvent > events;
+	TrafficTrace::Size maxBytes = 1;
+	for (int s = writer; s < trace.getStreamCount(); s += run->writers) {
+		const TrafficTrace::Records &records = trace.getRecords(s);
+		for (size_t i = 0; i < records.size(); i++) {
+			ReplayEvent e;
+			e.time_us = records[i].time_us;
+			e.stream = os.size();
+			e.bytes = records[i].bytes;
+			e.flush = records[i].flush;
+			events.push_back(e);
+			maxBytes = std::max(maxBytes, e.bytes);
+		}
+		os.push_back( marked_ostream_ptr( new marked_ostream(*run->fifo) ) );
+	}
+	stable_sort(events.begin(), events.end());
+	vector< char > payload(maxBytes, 'x');
+	vector< int64_t > lateness;
+	int64_t start = nowNanos();
+	for (size_t i = 0; i < events.size(); i++) {
+		const ReplayEvent &e = events[i];
+		if (run->speed > 0) {
+			int64_t due = start + (int64_t) (e.time_us * 1000 / run->speed), now = nowNanos();
+			if (now < due) {
+				// the max delay has no timer, quiet streams are flushed before sleeping
+				for (size_t j = 0; j < os.size(); j++)
+					os[j]->flushIfDue();
+				boost::this_thread::sleep( boost::posix_time::microseconds( (due - now) / 1000 ) );
+			}
+			lateness.push_back(std::max((int64_t) 0, now - due));
+		}
+		marked_ostream &out = *os[e.stream];
+		if (e.bytes > 0)
+			out.write(&payload[0], e.bytes);
+		out.setMark(e.flush);
+	}
+	os.clear();
+	{
+		boost::unique_lock< boost::mutex > l(run->mutex);
+		run->lateness.insert(run->lateness.end(), lateness.begin(), lateness.end());
+	}
+	if (--run->activeWriters == 0)
+		run->fifo->setEOF();
+}
+void replayRead(ReplayRun *run) {
+	vector< char > sink(65536);
+	int64_t bytes = 0;
+	{
+		marked_istream is(*run->fifo);
+		while (is.isReady(1000) || !run->fifo->isEOF()) {
+			while (is.isReady()) {
+				streamsize n = std::min((streamsize) sink.size(), is.rdbuf()->in_avail());
+				is.read(&sink[0], n);
+				bytes += n;
+			}
+		}
+	}
+	run->bytes += bytes;
+}
+double runReplay(Result &r, int threads, const TrafficTrace &trace, double speed, int bufferSize, int numBuffers, long maxDelay, bool autoTune) {
+	int writers, readers;
+	splitThreads(threads, writers, readers);
+	BufferFifo fifo(bufferSize, numBuffers);
+	fifo.setMaxDelay(maxDelay);
+	fifo.setAutoTune(autoTune);
+	ReplayRun run;
+	run.fifo = &fifo;
+	run.trace = &trace;
+	run.speed = speed;
+	run.writers = writers;
+	run.activeWriters = writers;
+	int64_t start = nowNanos();
+	boost::thread_group group;
+	for (int i = 0; i < readers; i++)
+		group.create_thread( boost::bind( &replayRead, &run ) );
+	for (int i = 0; i < writers; i++)
+		group.create_thread( boost::bind( &replayWrite, &run, i ) );
+	group.join_all();
+	double secs = (nowNanos() - start) / 1e9;
+	if (run.bytes.load() != trace.getBytes()) {
+		LOG("Warning: replay read " << run.bytes.load() << " of " << trace.getBytes() << " bytes");
+	}
+	sort(run.lateness.begin(), run.lateness.end());
+	if (!run.lateness.empty()) {
+		r.p50us = run.lateness[run.lateness.size() / 2] / 1000.0;
+		r.p99us = run.lateness[run.lateness.size() * 99 / 100] / 1000.0;
+	}
+	r.mbPerSec = run.bytes.load() / 1000000.0 / secs;
+	LOG(fifo.getState());
+	return secs;
+}
+
+int main(int argc, char *argv[]) {
+	Params params(argc, argv);
+	vector< string > benches = params.getList("bench", "queue,fifo,pool,stream");
+	vector< string > threadList = params.getList("threads", "1,2,4");
+	vector< string > dists = params.getList("dist", "fixed,uniform,exponential");
+	vector< string > placements = params.getList("placement", "none");
+	int size = params.getInt("size", 32);
+	int64_t ops = params.getInt("ops", 200000), messages = params.getInt("messages", 200000);
+	int bufferSize = params.getInt("bufferSize", 8192), numBuffers = params.getInt("numBuffers", 256);
+	int warmup = params.getInt("warmup", 1), repeat = params.getInt("repeat", 3);
+	Report report(params.get("format", "csv"));
+	string speed = params.get("speed", "1");
+	long maxDelay = params.getInt("maxDelay", 0);
+	bool autoTune = params.getInt("autoTune", 0) != 0;
+	StreamOptions streamOptions;
+	streamOptions.maxDelay = maxDelay;
+	streamOptions.autoTune = autoTune;
+	streamOptions.shared = params.getInt("shared", 0) != 0;
+	streamOptions.transport = params.get("transport", "fifo");
+	streamOptions.maxInFlight = params.getInt("maxInFlight", 0);
+	streamOptions.readAhead = params.getInt("readAhead", 0);
+	if (streamOptions.transport != "fifo" && streamOptions.transport != "unix" && streamOptions.transport != "tcp") {
+		LOG("Warning: unknown transport " << streamOptions.transport << ", using fifo");
+		streamOptions.transport = "fifo";
+	}
+	boost::shared_ptr< TrafficCapture > capture;
+	if (!params.get("capture", "").empty())
+		capture.reset( new TrafficCapture(params.get("capture", "")) );
+	TrafficTrace trace;
+	CpuTopology topology;
+	LOG(topology.getState());
+
+	for (size_t b = 0; b < benches.size(); b++) {
+		const string &bench = benches[b];
+		vector< string > variants;
+		if (bench == "queue") {
+			variants.push_back("BoundedQueue");
+			variants.push_back("boost::lockfree::queue");
+		} else if (bench == "stream") {
+			variants = dists;
+		} else if (bench == "fifo" || bench == "pool") {
+			variants.push_back(bench);
+		} else if (bench == "lines") {
+			variants.push_back(TextLines::getInstructionSet());
+			variants.push_back("scalar");
+			variants.push_back("getline");
+		} else if (bench == "replay") {
+			if (!trace.load(params.get("trace", ""))) {
+				LOG("Warning: replay needs --trace=file");
+				continue;
+			}
+			LOG(trace.getState());
+			variants.push_back(atof(speed.c_str()) > 0 ? "speed=" + speed : "asap");
+		} else {
+			LOG("Warning: unknown benchmark " << bench);
+			continue;
+		}
+		for (size_t t = 0; t < threadList.size(); t++) {
+			int threads = std::max(1, atoi(threadList[t].c_str()));
+			for (size_t v = 0; v < variants.size(); v++) {
+				for (size_t pl = 0; pl < (bench == "stream" ? placements.size() : 1); pl++) {
+					ThreadPlacement::Strategy strategy = ThreadPlacement::PlacementNone;
+					if (bench == "stream" && placements[pl] == "compact")
+						strategy = ThreadPlacement::PlacementCompact;
+					else if (bench == "stream" && placements[pl] == "spread")
+						strategy = ThreadPlacement::PlacementSpread;
+					for (int rep = -warmup; rep < repeat; rep++) {
+						Result r;
+						r.bench = bench;
+						r.variant = variants[v];
+						if (bench == "stream") {
+							r.variant = streamOptions.shared ? "shared_stream" : "marked_stream";
+							if (streamOptions.transport != "fifo")
+								r.variant += "_" + streamOptions.transport;
+						}
+						r.dist = bench == "stream" ? variants[v] : "";
+						r.placement = ThreadPlacement::getName(strategy);
+						r.threads = threads;
+						r.size = bench == "stream" || bench == "lines" ? size : sizeof(BufferPtr);
+						if (bench == "replay")
+							r.size = trace.getRecordCount() > 0 ? trace.getBytes() / trace.getRecordCount() : 0;
+						r.repeat = rep;
+						int producers, consumers;
+						splitThreads(threads, producers, consumers);
+						int64_t count = ops * producers;
+						if (bench == "queue" && v == 0) {
+							r.seconds = runQueue< BoundedQueue< BufferPtr > >(threads, ops, numBuffers);
+						} else if (bench == "queue") {
+							r.seconds = runQueue< boost::lockfree::queue< BufferPtr > >(threads, ops, numBuffers);
+						} else if (bench == "fifo") {
+							r.seconds = runFifo(threads, ops, bufferSize, numBuffers);
+						} else if (bench == "pool") {
+							r.seconds = runPool(threads, ops, bufferSize, numBuffers);
+							count = ops * threads;
+						} else if (bench == "lines") {
+							r.seconds = runLines(r, threads, variants[v], ops, size, bufferSize);
+							count = ops * threads;
+						} else if (bench == "replay") {
+							r.seconds = runReplay(r, threads, trace, atof(speed.c_str()), bufferSize, numBuffers, maxDelay, autoTune);
+							count = trace.getRecordCount();
+						} else {
+							// only the reported runs are captured, each with its own streams
+							streamOptions.capture = rep >= 0 ? capture.get() : NULL;
+							r.seconds = runStream(r, threads, topology, strategy, messages, bufferSize, numBuffers, streamOptions);
+							if (rep >= 0)
+								streamOptions.captureBase += producers;
+							count = messages * producers;
+						}
+						r.opsPerSec = count / r.seconds;
+						if (rep >= 0)
+							report.add(r);
+					}
+				}
+			}
+		}
+	}
+
+	string output = params.get("output", "-");
+	if (output == "-") {
+		report.write(cout);
+	} else {
+		ofstream ofs(output.c_str());
+		report.write(ofs);
+		LOG("Wrote " << output);
+	}
+	report.summarize();
+	if (capture.get() != NULL) {
+		capture->flush();
+		LOG(capture->getState());
+	}
+	return 0;
+}
@@ -3,6 +3,7 @@
 #ifndef _MARKED_IOSTREAM_H_
 #define _MARKED_IOSTREAM_H_
 
+#include <algorithm>
 #include <cstdio>
 #include <streambuf>
 #include <iostream>
@@ -12,12 +13,19 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/thread_time.hpp>
 
 #include "Buffer.hpp"
+#include "SharedBufferWriter.hpp"
+#include "TextLines.hpp"
+#include "TrafficCapture.hpp"
 
 // each thread should create its own marked_fifo_streambuf (and associated iostreams)
 // using the same BufferFifo...
 // the iostreams should call setMark() at regular (and frequent relative to bufferSize) intervals
+//
+// A stream takes a Buffer from the BufferFifo only on its first write or successful underflow,
+// and gives it back once it is pushed or exhausted, so idle streams hold no Buffer.
 
 class marked_fifo_streambuf : public std::streambuf {
 public:
@@ -25,46 +33,216 @@ public:
 	typedef Buffer::Size Size;
 	typedef std::streamsize streamsize;
 	typedef std::streampos streampos;
-
-	marked_fifo_streambuf(BufferFifo &bufFifo) 
-		: std::streambuf(), _bufFifo(&bufFifo), _buf(NULL), _prevBytes(0), _readOnly(false), _writeOnly(false) {
-		_buf = _bufFifo->getBuffer();
+	const static int MaxReadAhead = 4;
+	const static Size PrefetchBytes = 4096;
+	const static Size SharedStagingSize = 256;
+
+	// writers push to the BufferFifo priority lane given, readers drain all lanes
+	marked_fifo_streambuf(BufferFifo &bufFifo, int lane = 0) 
+		: std::streambuf(), _bufFifo(&bufFifo), _shared(NULL), _buf(NULL), _next(NULL), _prevBytes(0), _readWait(1000), _readAhead(0), _aheadCount(0),
+		  _idleTimeout(0), _maxDelay(bufFifo.getMaxDelay()), _textMode(false), _recorder(NULL), _lane(lane), _readOnly(false), _writeOnly(false) {}
+	// write only: each record is staged in a small private Buffer and appended to the
+	// SharedBufferWriter's Buffers at setMark(), instead of holding a whole Buffer per stream
+	marked_fifo_streambuf(SharedBufferWriter &shared)
+		: std::streambuf(), _bufFifo(&shared.getBufferFifo()), _shared(&shared), _buf(NULL), _next(NULL), _prevBytes(0), _readWait(1000), _readAhead(0), _aheadCount(0),
+		  _idleTimeout(0), _maxDelay(0), _textMode(false), _recorder(NULL), _lane(0), _readOnly(false), _writeOnly(false) {
+		_buf = new Buffer(SharedStagingSize);
 		setbuf(_buf->begin(), _buf->capacity());
 	}
 	virtual ~marked_fifo_streambuf() {
 		sync();
+		delete _recorder;
 		if (_readOnly) {
 			_bufFifo->deregisterReader();
-			if (_buf->getGetBufferUsed()) {
+			if (_buf != NULL && _buf->getGetBufferUsed()) {
 				LOG("Warning: getGetBufferUsed exists within ~marked_fifo_streambuf()");
 			}
 		}
 		if (_writeOnly) {
 			_bufFifo->deregisterWriter();
-			if (_buf->getPutBufferUsed()){
+			if (_buf != NULL && _buf->getPutBufferUsed()){
 				LOG("Warning: getPutBufferUsed exists within ~marked_fifo_streambuf()");
 			}
 		}
-		_bufFifo->returnBuffer(_buf);
+		if (_shared != NULL)
+			delete _buf;
+		else if (_buf != NULL)
+			_bufFifo->returnBuffer(_buf);
+		if (_next != NULL)
+			_bufFifo->returnBuffer(_next);
+		if (_aheadCount > 0) {
+			LOG("Warning: " << _aheadCount << " read-ahead Buffers are unread within ~marked_fifo_streambuf()");
+		}
+		for (int i = 0; i < _aheadCount; i++)
+			_bufFifo->returnBuffer(_ahead[i]);
 
 	}
 
 	int setMark(bool flush = false) {
 		assert(_writeOnly);
+		if (_buf == NULL)
+			return 0; // nothing written
+		bool pending = _buf->getMark() > 0; // complete records are waiting in _buf
 		int lastMarkSize = _buf->setMark();
+		if (_idleTimeout > 0 || _maxDelay > 0) {
+			_lastMark = boost::get_system_time();
+			if (!pending) {
+				_firstMark = _lastMark;
+			} else if (_maxDelay > 0 && !flush && (_lastMark - _firstMark).total_microseconds() >= _maxDelay) {
+				_bufFifo->countDelayedFlush();
+				flush = true;
+			}
+		}
+		if (_recorder != NULL)
+			_recorder->mark(lastMarkSize, flush);
+		if (_shared != NULL) {
+			if (_buf->size() > 0)
+				_shared->write(_buf->begin(), _buf->size());
+			_prevBytes += _buf->size();
+			_buf->clear();
+			if (flush)
+				_shared->flush();
+			return lastMarkSize;
+		}
 		if (flush || lastMarkSize >= _buf->premainder()) {
 			overflow(EOF);
 		}
 		return lastMarkSize;
 	}
 
+	// ensure bytes can be written without blocking on the BufferFifo's credit limit.
+	// returns false (without blocking) if they would not fit and no credit is available
+	bool tryReserve(Size bytes) {
+		setWriteOnly();
+		if (_shared != NULL || _next != NULL || (_buf != NULL && bytes <= _buf->premainder()))
+			return true;
+		_next = _bufFifo->tryGetBuffer();
+		return _next != NULL;
+	}
+
+	// the fifo is at EOF and a reader holds nothing unread, in its Buffer or read-ahead
 	bool isEOF() const {
-		return _bufFifo->isEOF();
+		return _bufFifo->isEOF() && _aheadCount == 0 && (!_readOnly || getRemainder() == 0);
 	}
 
 	BufferFifo &getBufferFifo() {
 		return *_bufFifo;
 	}
+	int getLane() const {
+		return _lane;
+	}
+	// skip up to n whole records using the Buffers' record index (see BufferFifo::setRecordIndex)
+	// without reading them.  Must be called at a record boundary.
+	// returns the number skipped, fewer at EOF or if a Buffer is not indexed
+	int64_t skipRecords(int64_t n) {
+		setReadOnly();
+		int64_t skipped = 0;
+		while (skipped < n) {
+			if (getRemainder() == 0 && underflow() == EOF)
+				break;
+			if (!_buf->isIndexed())
+				break;
+			Size offset = _buf->greturned();
+			Size record = _buf->findRecord(offset);
+			assert(record == _buf->getRecordCount() || _buf->getRecordBegin(record) == offset);
+			Size available = _buf->getRecordCount() - record;
+			if (available <= 0) {
+				// unindexed trailing bytes
+				break;
+			}
+			Size count = (Size) std::min((int64_t) available, n - skipped);
+			_buf->gbump(_buf->getRecordBegin(record + count) - offset);
+			skipped += count;
+		}
+		return skipped;
+	}
+
+	// microseconds underflow() may block waiting on the BufferFifo, 0 never blocks
+	void setReadWait(long wait_us) {
+		_readWait = wait_us;
+	}
+
+	// keep up to depth Buffers popped (and their first bytes prefetched) ahead of the one being read,
+	// so the reader does not wait on the fifo or a cold cache at Buffer boundaries.
+	// Read-ahead Buffers are taken from other readers of the same fifo, so keep depth small.
+	void setReadAhead(int depth) {
+		_readAhead = std::max(0, std::min(depth, (int) MaxReadAhead));
+	}
+	int getReadAhead() const {
+		return _readAhead;
+	}
+
+	// a writer idle for longer than this (since its last setMark()) releases its Buffer in
+	// releaseIfIdle(), pushing the complete records.  0 (the default) disables it.
+	void setIdleTimeout(long timeout_us) {
+		_idleTimeout = timeout_us;
+		_lastMark = boost::get_system_time();
+	}
+	// called periodically by the owning thread, returns true if the Buffer was released
+	bool releaseIfIdle() {
+		if (!_writeOnly || _shared != NULL || _buf == NULL || _idleTimeout <= 0)
+			return false;
+		if (_buf->markRemainder() > 0 || (boost::get_system_time() - _lastMark).total_microseconds() < _idleTimeout)
+			return false; // busy, or within a record
+		if (_buf->size() > 0)
+			overflow(EOF); // pushes and releases
+		else
+			releaseBuffer();
+		return true;
+	}
+
+	// Nagle-style latency bound: records are coalesced until the Buffer is full, but the Buffer is
+	// pushed at the first setMark() after its oldest record has waited maxDelay_us.
+	// There is no timer: a stream that goes quiet keeps its records until the owning thread
+	// calls setMark() or flushIfDue() again (or flush()), so the bound only holds while it does.
+	// Defaults to the BufferFifo's setMaxDelay(), 0 disables it.  Not used with a SharedBufferWriter.
+	void setMaxDelay(long maxDelay_us) {
+		_maxDelay = maxDelay_us;
+		_firstMark = boost::get_system_time();
+	}
+	long getMaxDelay() const {
+		return _maxDelay;
+	}
+	// for streams that may not setMark() again soon: called periodically by the owning thread
+	// (i.e. before it sleeps or blocks), pushes the complete records if the oldest has waited maxDelay.
+	// Streams are not thread safe, so no other thread can sweep them.  Returns true if a Buffer was pushed
+	bool flushIfDue() {
+		if (!_writeOnly || _shared != NULL || _buf == NULL || _maxDelay <= 0 || _buf->getMark() == 0)
+			return false;
+		if ((boost::get_system_time() - _firstMark).total_microseconds() < _maxDelay)
+			return false;
+		_bufFifo->countDelayedFlush();
+		overflow(EOF);
+		return true;
+	}
+
+	// newline delimited text: writes mark after their last newline, so records and Buffers hold whole lines
+	void setTextMode(bool textMode) {
+		_textMode = textMode;
+	}
+	bool getTextMode() const {
+		return _textMode;
+	}
+	// appends the lines of the current Buffer (popping the next one if it is exhausted) and consumes them.
+	// For streams written in text mode.  The lines point into the Buffer, valid until the next read from this stream.
+	// returns the number of lines appended, 0 at EOF
+	int readLines(std::vector< TextLines::Line > &lines) {
+		setReadOnly();
+		if (getRemainder() == 0 && underflow() == EOF)
+			return 0;
+		size_t before = lines.size();
+		TextLines::splitBuffer(*_buf, lines);
+		return lines.size() - before;
+	}
+	// record this stream's marks (record sizes, flushes and timing) in capture as stream streamId, NULL stops
+	void setCapture(TrafficCapture *capture, int streamId) {
+		delete _recorder;
+		_recorder = capture == NULL ? NULL : new TrafficCapture::Recorder(*capture, streamId);
+	}
+	// whether a Buffer is held
+	bool hasBuffer() const {
+		return _buf != NULL;
+	}
 
 protected:
 	// should not be called on streambuf directly...
@@ -73,9 +251,9 @@ protected:
 	}
 
 protected:
-	char* eback() const { setReadOnly(); return _buf->begin(); }
-	char* gptr() const { setReadOnly(); return _buf->gbegin(); }
-	char* egptr() const { setReadOnly(); return _buf->gend(); }
+	char* eback() const { setReadOnly(); return _buf == NULL ? NULL : _buf->begin(); }
+	char* gptr() const { setReadOnly(); return _buf == NULL ? NULL : _buf->gbegin(); }
+	char* egptr() const { setReadOnly(); return _buf == NULL ? NULL : _buf->gend(); }
 	void gbump(int n) {
 		setReadOnly();
 		_buf->gbump(n);
@@ -85,9 +263,9 @@ protected:
 		_buf->setg(gbeg, gnext, gend);
 	}
 	
-	char* pbase() const { setWriteOnly(); return _buf->begin(); }
-	char* pptr() const { setWriteOnly(); return _buf->pbegin(); }
-	char* epptr() const { setWriteOnly(); return _buf->pend(); }
+	char* pbase() const { setWriteOnly(); return _buf == NULL ? NULL : _buf->begin(); }
+	char* pptr() const { setWriteOnly(); return _buf == NULL ? NULL : _buf->pbegin(); }
+	char* epptr() const { setWriteOnly(); return _buf == NULL ? NULL : _buf->pend(); }
 	void pbump(int n) {
 		setWriteOnly();
 		_buf->pbump(n);
@@ -98,7 +276,20 @@ protected:
 	}
 	void swap(marked_fifo_streambuf &rhs) {
 		std::swap(_bufFifo, rhs._bufFifo);
+		std::swap(_shared, rhs._shared);
 		std::swap(_buf, rhs._buf);
+		std::swap(_next, rhs._next);
+		std::swap(_readAhead, rhs._readAhead);
+		std::swap(_aheadCount, rhs._aheadCount);
+		std::swap(_idleTimeout, rhs._idleTimeout);
+		std::swap(_lastMark, rhs._lastMark);
+		std::swap(_maxDelay, rhs._maxDelay);
+		std::swap(_firstMark, rhs._firstMark);
+		std::swap(_textMode, rhs._textMode);
+		std::swap(_recorder, rhs._recorder);
+		for (int i = 0; i < MaxReadAhead; i++)
+			std::swap(_ahead[i], rhs._ahead[i]);
+		std::swap(_lane, rhs._lane);
 		std::swap(_readOnly, rhs._readOnly);
 		std::swap(_writeOnly, rhs._writeOnly);
 	}
@@ -116,9 +307,9 @@ protected:
 	std::streampos seekoff (std::streamoff off, std::ios_base::seekdir way, std::ios_base::openmode which = std::ios_base::in | std::ios_base::out) {
 		if (way == std::ios_base::cur && off == 0) {
 			if (!_readOnly && (which & std::ios_base::out) == std::ios_base::out)
-				return _prevBytes + _buf->size();
+				return _prevBytes + (_buf == NULL ? 0 : _buf->size());
 			if (!_writeOnly && (which & std::ios_base::in) == std::ios_base::in)
-				return _prevBytes + _buf->greturned();
+				return _prevBytes + (_buf == NULL ? 0 : _buf->greturned());
 		}
 		return -1; // unsupported
 	}
@@ -128,9 +319,9 @@ protected:
 
 	int sync() {
 		//LOG("marked_fifo_streambuf::sync()");
-		if (_writeOnly && _buf->pbuffered() > 0)
+		if (_writeOnly && _buf != NULL && _buf->pbuffered() > 0)
 			setMark(true);
-		if (_readOnly && _buf->gremainder() == 0)
+		if (_readOnly && getRemainder() == 0)
 			underflow();
 		return 0;
 	};
@@ -138,54 +329,59 @@ protected:
 	// get virtuals
 	streamsize showmanyc() { 
 		setReadOnly();
-		return _buf->gremainder();
+		if (getRemainder() == 0 && _aheadCount > 0)
+			underflow(); // does not block
+		return getRemainder();
 	}
+	// reads within the current Buffer only, as records never span Buffers.
+	// Readers call isReady() to move on to the next one
 	streamsize xsgetn (char* s, streamsize n) {
 		setReadOnly();
-		return _buf->read(s, n);
+		return _buf == NULL ? 0 : _buf->read(s, n);
 	}
 	int underflow() {
+		BUFFER_TRACE_START(start);
 		setReadOnly();
-		assert(_buf->gremainder() == 0);
-		// get a new _buf from the fifo stream
+		assert(getRemainder() == 0);
+		// get a new _buf from the read-ahead or the fifo stream
 		BufferPtr next = NULL;
-		// get a new _buf from the fifo stream
-		if (_bufFifo->pop(next)) {
-			// put _buf back in the pool
-			_prevBytes += _buf->size();
-			_bufFifo->returnBuffer(_buf);
+		if (_aheadCount > 0) {
+			next = _ahead[0];
+			for (int i = 1; i < _aheadCount; i++)
+				_ahead[i-1] = _ahead[i];
+			_aheadCount--;
+		}
+		bool popped = next != NULL || _bufFifo->pop(next, _readWait);
+		// put the exhausted _buf back in the pool
+		releaseBuffer();
+		if (popped) {
 			_buf = next;
-		} // else keep this old, exhausted _buf active
-		if (_buf->gremainder() == 0)
+			fillReadAhead();
+		}
+		BUFFER_TRACE_SPAN("underflow", start, _buf, getRemainder());
+		if (getRemainder() == 0)
 			return EOF;
-		return *_buf->gbegin();
+		// a 0xff byte must not read as EOF
+		return traits_type::to_int_type(*_buf->gbegin());
 	}
 	//using int uflow();
 	//using int pbackfail (int c = EOF);
 
 	// put virtuals
 	streamsize xsputn (const char* s, streamsize n) {
-		assert(n>0);
-		setWriteOnly();
-		//LOG("marked_fifo_streambuf::xsputn(" << n << ")");
-		if (n > _buf->premainder()) {
-			if (_buf->getMark() > 0 && n < _buf->capacity()) {
-				// message will pass if buf is empty
-				overflow(EOF);
-			} else {
-				// buffer is insufficient to hold this message
-				streamsize markRemainder = _buf->markRemainder();
-				if (n + markRemainder >= _bufFifo->getBufferSize()) {
-					_bufFifo->setBufferSize( 4 * (n+markRemainder) );
-				}
-				if (_buf->getMark() > 0)
-					overflow(EOF);
-				else if (n > _buf->premainder() )
-					_buf->resize( _bufFifo->getBufferSize() );
-				assert(n < _buf->premainder());
+		if (_textMode && n > 0) {
+			// mark after the last whole line
+			const char *nl = TextLines::findLastNewline(s, s + n);
+			if (nl != NULL) {
+				streamsize head = nl + 1 - s;
+				putBytes(s, head);
+				setMark();
+				if (head < n)
+					putBytes(nl + 1, n - head);
+				return n;
 			}
 		}
-		return _buf->write(s, n);
+		return putBytes(s, n);
 	}
 	streamsize sputn(const char* s, streamsize n) {
 		return xsputn(s,n);
@@ -195,36 +391,117 @@ protected:
 	}
 
 	int overflow (int c = EOF) {
+		BUFFER_TRACE_START(start);
 		setWriteOnly();
-		// get a new Buffer from the pool
-		BufferPtr next = _bufFifo->getBuffer();
-		//LOG((long) this << "-overflow: " << _buf);
-
-		// check for trailing bytes after the mark & move to next buffer
+		if (c != EOF) {
+			// std::streambuf::sputc() (i.e. ostream::put, std::endl) lands here, as the put area is not exposed
+			char c1 = (char) c;
+			xsputn(&c1, 1);
+			return c;
+		}
+		if (_shared != NULL || _buf == NULL)
+			return c;
+		// check for trailing bytes after the mark & move to next buffer.
+		// Without any, the next Buffer is only acquired on the next write
+		BufferPtr next = NULL;
 		int markRemainder = _buf->markRemainder();
 		if (markRemainder > 0) {
+			// a new Buffer from the pool, or the one already reserved
+			next = _next;
+			if (next == NULL)
+				next = _bufFifo->getBuffer();
+			_next = NULL;
 			next->write(_buf->beginMark(), markRemainder);
 			_buf->clear(_buf->getMark());
 		}
+		//LOG((long) this << "-overflow: " << _buf);
 
 		_prevBytes += _buf->size();
 		// push old to the fifo stream
-		assert(_buf != NULL);
-		_bufFifo->push(_buf);
+		_bufFifo->push(_buf, 0, _lane);
 		assert(_buf == NULL);
 
-		// assign new buffer and optionally write the next char
+		BUFFER_TRACE_SPAN("overflow", start, next, markRemainder);
 		_buf = next;
-		if (c != EOF) {
-			char c1 = (char) c;
-			_buf->write(&c1,1);
-		}
 		return c;
 	}
 	
 private:
+	streamsize putBytes(const char* s, streamsize n) {
+		assert(n>0);
+		setWriteOnly();
+		if (_buf == NULL)
+			acquireBuffer();
+		//LOG("marked_fifo_streambuf::xsputn(" << n << ")");
+		if (_shared != NULL && n > _buf->premainder()) {
+			// the staging Buffer grows to the largest record
+			_buf->resize( std::max(2 * _buf->capacity(), _buf->size() + (Size) n + 64) );
+		} else if (n > _buf->premainder()) {
+			if (_buf->getMark() > 0 && n + indexReserve() < _buf->capacity()) {
+				// message will pass if buf is empty
+				overflow(EOF);
+				if (_buf == NULL)
+					acquireBuffer();
+			} else {
+				// buffer is insufficient to hold this message
+				streamsize markRemainder = _buf->markRemainder();
+				if (n + markRemainder + indexReserve() >= _bufFifo->getBufferSize()) {
+					_bufFifo->setBufferSize( 4 * (n + markRemainder + indexReserve()) );
+				}
+				if (_buf->getMark() > 0)
+					overflow(EOF);
+				if (_buf == NULL)
+					acquireBuffer();
+			}
+			// the record index trailer takes from the capacity too
+			if (n > _buf->premainder())
+				_bufFifo->resizeBuffer( _buf, std::max(_bufFifo->getBufferSize(), _buf->size() + (Size) n + indexReserve()) );
+			assert(n <= _buf->premainder());
+		}
+		return _buf->write(s, n);
+	}
+	// the index trailer of _buf, including the slot for the record being written
+	Size indexReserve() const {
+		return _buf->isIndexed() ? (_buf->getRecordCount() + 1) * (Size) sizeof(Size) : 0;
+	}
+	Size getRemainder() const {
+		return _buf == NULL ? 0 : _buf->gremainder();
+	}
+	// first write: the Buffer reserved by tryReserve(), or a new one
+	void acquireBuffer() {
+		assert(_buf == NULL);
+		_buf = _next != NULL ? _next : _bufFifo->getBuffer();
+		_next = NULL;
+	}
+	void releaseBuffer() {
+		if (_buf != NULL) {
+			_prevBytes += _buf->size();
+			_bufFifo->returnBuffer(_buf);
+			_buf = NULL;
+		}
+	}
+
+	// pop without waiting until _readAhead Buffers are held
+	void fillReadAhead() {
+		while (_aheadCount < _readAhead) {
+			BufferPtr p = NULL;
+			if (!_bufFifo->pop(p, 0))
+				break;
+			prefetch(p);
+			_ahead[_aheadCount++] = p;
+		}
+	}
+	static void prefetch(BufferPtr p) {
+#ifdef __GNUC__
+		const char *c = p->gbegin();
+		Size bytes = p->gremainder() < PrefetchBytes ? p->gremainder() : PrefetchBytes;
+		for (Size i = 0; i < bytes; i += 64)
+			__builtin_prefetch(c + i, 0, 3);
+#endif
+	}
+
 	inline void setReadOnly() const {
-		assert(!_writeOnly);
+		assert(!_writeOnly && _shared == NULL);
 		if (!_readOnly) {
 			_bufFifo->registerReader();
 			_readOnly = true;
@@ -240,8 +517,17 @@ private:
 
 private:
 	BufferFifo *_bufFifo;
-	BufferPtr _buf;
+	SharedBufferWriter *_shared;
+	BufferPtr _buf, _next;
 	int64_t _prevBytes;
+	long _readWait;
+	int _readAhead, _aheadCount;
+	BufferPtr _ahead[MaxReadAhead];
+	long _idleTimeout, _maxDelay;
+	boost::system_time _lastMark, _firstMark; // the last setMark(), the first one of the records in _buf
+	bool _textMode;
+	TrafficCapture::Recorder *_recorder;
+	int _lane;
 	mutable bool _readOnly, _writeOnly;
 };
 
@@ -257,6 +543,20 @@ public:
 		return (marked_fifo_streambuf *) ((std::istream*) this)->rdbuf();
 	}
 
+	int64_t skipRecords(int64_t n) {
+		return rdbuf()->skipRecords(n);
+	}
+	void setReadAhead(int depth) {
+		rdbuf()->setReadAhead(depth);
+	}
+	bool isEOF() {
+		return rdbuf()->isEOF();
+	}
+	// bulk alternative to std::getline for text mode streams, see marked_fifo_streambuf::readLines
+	int readLines(std::vector< TextLines::Line > &lines) {
+		return rdbuf()->readLines(lines);
+	}
+
 	bool isReady(long blockMicroSeconds = 0) {
 		if (rdbuf()->in_avail() > 0)
 			return true;
@@ -282,8 +582,11 @@ public:
 
 class marked_ostream : public std::ostream {
 public:
-	marked_ostream(BufferFifo &bufFifo) 
-		: std::ostream( new marked_fifo_streambuf( bufFifo ) ) {}
+	marked_ostream(BufferFifo &bufFifo, int lane = 0) 
+		: std::ostream( new marked_fifo_streambuf( bufFifo, lane ) ) {}
+	// records are combined with those of other streams sharing the writer
+	marked_ostream(SharedBufferWriter &shared)
+		: std::ostream( new marked_fifo_streambuf( shared ) ) {}
 
 	virtual ~marked_ostream() {
 		delete rdbuf();
@@ -294,6 +597,27 @@ public:
 	int setMark(bool flush = false) {
 		return rdbuf()->setMark(flush);
 	}
+	bool tryReserve(Buffer::Size bytes) {
+		return rdbuf()->tryReserve(bytes);
+	}
+	void setIdleTimeout(long timeout_us) {
+		rdbuf()->setIdleTimeout(timeout_us);
+	}
+	bool releaseIfIdle() {
+		return rdbuf()->releaseIfIdle();
+	}
+	void setMaxDelay(long maxDelay_us) {
+		rdbuf()->setMaxDelay(maxDelay_us);
+	}
+	void setTextMode(bool textMode) {
+		rdbuf()->setTextMode(textMode);
+	}
+	void setCapture(TrafficCapture *capture, int streamId) {
+		rdbuf()->setCapture(capture, streamId);
+	}
+	bool flushIfDue() {
+		return rdbuf()->flushIfDue();
+	}
 
 };
 
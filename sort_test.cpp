@@ -0,0 +1,89 @@
+// module load boost/1.53.0
+// g++ -Wall -O3 -fopenmp -I $BOOST_DIR/include -L $BOOST_DIR/lib sort_test.cpp -lboost_system -lboost_thread
+//
+// ExternalSort benchmark on synthetic BlockId-tagged records: int32 bytes, int32 blockId, payload
+// sort_test [records] [avgPayloadBytes] [memoryBudgetMB] [fanIn] [sortThreads]
+
+#include "Buffer.hpp"
+#include "marked_iostream.hpp"
+#include "ExternalSort.hpp"
+
+#ifdef _OPENMP
+#include "omp.h"
+#else
+int omp_get_thread_num() { return 0; }
+int omp_get_num_threads() { return 1; }
+#endif
+
+#include <vector>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using namespace std;
+
+// order by blockId, the second int32 of the record
+bool blockIdLess(const char *a, Buffer::Size aLen, const char *b, Buffer::Size bLen) {
+	int32_t idA, idB;
+	memcpy(&idA, a + sizeof(int32_t), sizeof(int32_t));
+	memcpy(&idB, b + sizeof(int32_t), sizeof(int32_t));
+	return idA < idB;
+}
+
+int main(int argc, char *argv[]) {
+	int64_t records = 1000000;
+	int payloadMean = 32;
+	int64_t memoryBudgetMB = 16;
+	int fanIn = 16, sortThreads = 1;
+	if (argc >= 2) records = atol(argv[1]);
+	if (argc >= 3) payloadMean = atoi(argv[2]);
+	if (argc >= 4) memoryBudgetMB = atol(argv[3]);
+	if (argc >= 5) fanIn = atoi(argv[4]);
+	if (argc >= 6) sortThreads = atoi(argv[5]);
+	LOG("records: " << records << ", avgPayloadBytes: " << payloadMean << ", memoryBudget: " << memoryBudgetMB << " MB, fanIn: " << fanIn << ", sortThreads: " << sortThreads);
+
+	ExternalSort sorter(blockIdLess, memoryBudgetMB << 20, fanIn, sortThreads, 65536, 256);
+	sorter.start();
+	boost::system_time start = boost::get_system_time();
+
+#pragma omp parallel
+	{
+		int threadId = omp_get_thread_num(), numThreads = omp_get_num_threads();
+		boost::random::mt19937 rng; rng.seed( threadId + 1 );
+		boost::random::uniform_int_distribution<int32_t> ids(0, 1 << 30), payload(1, 2 * payloadMean);
+		vector< char > record(3 * payloadMean + 2 * sizeof(int32_t));
+		marked_ostream os(sorter.getInput());
+		for (int64_t i = threadId; i < records; i += numThreads) {
+			int32_t bytes = payload(rng), id = ids(rng);
+			memcpy(&record[0], &bytes, sizeof(int32_t));
+			memcpy(&record[sizeof(int32_t)], &id, sizeof(int32_t));
+			os.write(&record[0], bytes + 2 * sizeof(int32_t));
+			os.setMark();
+		}
+	}
+	sorter.getInput().setEOF();
+	boost::system_time written = boost::get_system_time();
+
+	marked_istream is(sorter.getOutput());
+	int64_t count = 0, bytes = 0;
+	int32_t lastId = -1, hdr[2];
+	bool sorted = true;
+	vector< char > payload(4 * payloadMean);
+	while (is.isReady(1000) || !sorter.getOutput().isEOF()) {
+		while (is.isReady()) {
+			is.read((char*) hdr, sizeof(hdr));
+			is.read(&payload[0], hdr[0]);
+			sorted &= hdr[1] >= lastId;
+			lastId = hdr[1];
+			bytes += hdr[0] + sizeof(hdr);
+			count++;
+		}
+	}
+	sorter.join();
+	boost::system_time end = boost::get_system_time();
+
+	double secs = (end - start).total_microseconds() / 1000000.0;
+	LOG("Sorted " << count << " of " << records << " records, " << (bytes / 1000000.0) << " MB in " << secs << "s (" << (bytes / 1000000.0 / secs) << " MB/s), write phase " << (written - start).total_milliseconds() << "ms, sorted: " << sorted);
+	LOG(sorter.getState());
+	return (count == records && sorted && sorter.isOk()) ? 0 : 1;
+}
@@ -3,6 +3,7 @@
 
 #include "Buffer.hpp"
 #include "marked_iostream.hpp"
+#include "StreamSelector.hpp"
 
 #ifdef _OPENMP
 #include "omp.h"
@@ -183,6 +184,7 @@ int main(int argc, char *argv[]) {
 	vector< marked_ostream_ptr > os(num, marked_ostream_ptr());
 	vector< float > mbps(omp_get_max_threads(), 0);
 
+	// transport, credit limit, thread placement and read-ahead are swept by bench.cpp --bench=stream
 	int cycles = 1000;
 	int burstMean = 32, burstStd;
 	int waitMicroMean = 0, waitMicroStd;
@@ -204,6 +206,9 @@ int main(int argc, char *argv[]) {
 	if (argc >= 6) {
 		numBuffers = atoi(argv[5]);
 	}
+#ifdef BUFFER_TRACE
+	BufferTrace::enable();
+#endif
 	LOG("cycles: " << cycles << ", avgMessageBytes: " << burstMean << ", avgMessageDelay: " << waitMicroMean << " us, bufferSize: " << bufferSize << ", numBuffers: " << numBuffers);
 
 	int activeWriters, readers, writers;
@@ -241,23 +246,27 @@ int main(int argc, char *argv[]) {
 			//std::cout << "Starting thread " << threadId << std::endl;
 			if (threadId < readers) {
 				MessageTest msg;
-				// scan through all os until no more writers
-				int lastpass = 1;
-				while(lastpass) {
-					if (bfifo.isEOF())
-						lastpass--;
-					for(int i = 0; i < num ; i++) {
-						if ((i % readers) != threadId)
-							continue;
+				// wait on this thread's streams until no more writers
+				StreamSelector selector;
+				vector< int > ready;
+				for(int i = 0; i < num ; i++) {
+					if ((i % readers) != threadId)
+						continue;
+					selector.add(*is[i]);
+				}
+				while(!selector.isEOF()) {
+					selector.select(ready, 1000);
+					for(int r = 0; r < (int) ready.size(); r++) {
+						marked_istream &in = selector.getStream(ready[r]);
 						int messages = 0, totalBytes = 0;
-						assert(is[i]->good());
-						while (is[i]->isReady()) {
-							msg.read(*is[i]);
+						assert(in.good());
+						while (in.isReady()) {
+							msg.read(in);
 							totalBytes += msg.getBytes();
 							myBytes += msg.getBytes();
 							assert(msg.validate());
 							messages++;
-							assert(is[i]->good());
+							assert(in.good());
 						}
 						myMessages += messages;
 					}
@@ -331,7 +340,11 @@ int main(int argc, char *argv[]) {
 		LOG(bfifo.getState());
 		assert(outMessages == inMessages);
 	} // number of readers
-
+#ifdef BUFFER_TRACE
+	if (BufferTrace::dump("ParallelStreams.trace.json")) {
+		LOG("Wrote ParallelStreams.trace.json");
+	}
+#endif
 
 	return 0;
 }
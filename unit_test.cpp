@@ -0,0 +1,1164 @@
+// module load boost/1.53.0
+// g++ -Wall -g -I $BOOST_DIR/include -L $BOOST_DIR/lib unit_test.cpp -lboost_system -lboost_thread
+// add -std=c++20 for the coroutines test, and -mssse3 for the SSSE3 header decode of RecordCodec
+//
+// Functional tests of the BufferFifo extensions; test.cpp, bench.cpp and sort_test.cpp measure throughput.
+// unit_test [test ...]   runs the named tests, all of them by default.  Exits non-zero if any check failed.
+
+#include "Buffer.hpp"
+#include "marked_iostream.hpp"
+#include "SocketTransport.hpp"
+#include "Pipeline.hpp"
+#include "CoroutineStreams.hpp"
+#include "RecordCodec.hpp"
+#include "KeyValueCombiner.hpp"
+#include "ExternalSort.hpp"
+#include "SharedBufferWriter.hpp"
+#include "StreamSelector.hpp"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/exponential_distribution.hpp>
+
+using namespace std;
+
+static int failures = 0;
+#define CHECK(cond) { if (!(cond)) { LOG("FAILED: " #cond " at line " << __LINE__); failures++; } }
+
+// count int64 records, 0, 1, 2 ... from one stream
+static void writeSequence(BufferFifo &fifo, int64_t count, int64_t first = 0) {
+	marked_ostream os(fifo);
+	for (int64_t i = first; i < first + count; i++) {
+		os.write((const char*) &i, sizeof(i));
+		os.setMark();
+	}
+}
+// reads the records of writeSequence() until EOF, returning how many were in order
+static int64_t readSequence(BufferFifo &fifo, int64_t first = 0) {
+	marked_istream is(fifo);
+	int64_t next = first, v;
+	while (is.isReady(1000)) {
+		while (is.isReady()) {
+			is.read((char*) &v, sizeof(v));
+			if (v == next)
+				next++;
+		}
+	}
+	return next - first;
+}
+
+// socket: Buffers cross a socketpair in order, the last Buffer before a quiet sender is pushed
+// without waiting for the next frame, and a connection closed before the EOF frame
+// or a corrupt frame length still ends the reader's stream, but flagged as failed
+void testSocket() {
+	SocketTransport::FrameHeader h;
+	h.set(0x01020304, 5);
+	CHECK(((unsigned char*) &h.bytes)[0] == 1 && ((unsigned char*) &h.bytes)[3] == 4);
+	CHECK(h.getBytes() == 0x01020304 && h.getMark() == 5);
+	h.set(-1, 0);
+	CHECK(h.getBytes() == -1);
+
+	int fds[2];
+	CHECK(SocketTransport::unixPair(fds));
+	{
+		BufferFifo out(1024, 64), in(1024, 64);
+		BufferFifoSocketSender sender(out, fds[0]);
+		BufferFifoSocketReceiver receiver(in, fds[1]);
+		sender.start();
+		receiver.start();
+		writeSequence(out, 20000);
+		out.setEOF();
+		CHECK(readSequence(in) == 20000);
+		sender.join();
+		receiver.join();
+		CHECK(sender.isOk() && receiver.isOk() && in.isOk());
+	}
+	close(fds[0]);
+	close(fds[1]);
+
+	CHECK(SocketTransport::unixPair(fds));
+	{
+		BufferFifo in(1024, 64);
+		BufferFifoSocketReceiver receiver(in, fds[1]);
+		receiver.start();
+		// a frame announcing 100 bytes, of which 10 arrive
+		char payload[10] = {0};
+		h.set(100, 100);
+		CHECK(write(fds[0], &h, sizeof(h)) == sizeof(h));
+		CHECK(write(fds[0], payload, sizeof(payload)) == sizeof(payload));
+		close(fds[0]);
+		CHECK(readSequence(in) == 0);
+		receiver.join();
+		CHECK(!receiver.isOk());
+		CHECK(in.isEOF() && !in.isOk());
+	}
+	close(fds[1]);
+
+	CHECK(SocketTransport::unixPair(fds));
+	{
+		BufferFifo in(1024, 64);
+		BufferFifoSocketReceiver receiver(in, fds[1]);
+		receiver.start();
+		int64_t v = 42;
+		h.set(sizeof(v), sizeof(v));
+		CHECK(write(fds[0], &h, sizeof(h)) == sizeof(h));
+		CHECK(write(fds[0], &v, sizeof(v)) == sizeof(v));
+		BufferFifo::BufferPtr p = NULL;
+		CHECK(in.pop(p, 5000000) && p->size() == sizeof(v) && *((int64_t*) p->begin()) == 42);
+		if (p != NULL)
+			in.returnBuffer(p);
+		h.setEOF();
+		CHECK(write(fds[0], &h, sizeof(h)) == sizeof(h));
+		receiver.join();
+		CHECK(receiver.isOk() && in.isEOF() && in.isOk());
+	}
+	close(fds[0]);
+	close(fds[1]);
+
+	Buffer::Size corrupt[2] = { -2, 1 << 30 };
+	for (int i = 0; i < 2; i++) {
+		CHECK(SocketTransport::unixPair(fds));
+		BufferFifo in(1024, 64);
+		BufferFifoSocketReceiver receiver(in, fds[1], true, 1 << 20);
+		receiver.start();
+		h.set(corrupt[i], 0);
+		CHECK(write(fds[0], &h, sizeof(h)) == sizeof(h));
+		receiver.join();
+		CHECK(!receiver.isOk() && in.isEOF() && !in.isOk());
+		close(fds[0]);
+		close(fds[1]);
+	}
+}
+
+static void checkCreditReturned(BufferFifo &fifo) {
+	CHECK(fifo.getCreditBuffers() == 0);
+	CHECK(fifo.getCreditBytes() == 0);
+}
+
+// credit: under a limit of Buffers or of bytes, tryGetBuffer() fails once it is reached,
+// and getBuffer() blocks until a Buffer is returned
+static void takeBuffer(BufferFifo *fifo, BufferFifo::BufferPtr *p, boost::atomic<bool> *done) {
+	*p = fifo->getBuffer();
+	*done = true;
+}
+static void checkCreditBlocks(BufferFifo &fifo, int available) {
+	vector< BufferFifo::BufferPtr > held;
+	for (int i = 0; i < available; i++) {
+		BufferFifo::BufferPtr p = fifo.tryGetBuffer();
+		CHECK(p != NULL);
+		if (p != NULL)
+			held.push_back(p);
+	}
+	CHECK(!fifo.hasCredit() && fifo.tryGetBuffer() == NULL);
+	BufferFifo::BufferPtr blocked = NULL;
+	boost::atomic<bool> done(false);
+	boost::thread taker( boost::bind( takeBuffer, &fifo, &blocked, &done ) );
+	boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+	CHECK(!done.load());
+	fifo.returnBuffer(held.back());
+	held.pop_back();
+	CHECK(taker.timed_join(boost::posix_time::seconds(5)) && done.load());
+	if (blocked != NULL)
+		held.push_back(blocked);
+	CHECK(fifo.getCreditBuffers() == available);
+	for (size_t i = 0; i < held.size(); i++)
+		fifo.returnBuffer(held[i]);
+	CHECK(fifo.hasCredit());
+	checkCreditReturned(fifo);
+}
+void testCredit() {
+	{
+		BufferFifo fifo(1024, 16);
+		fifo.setCreditLimit(3);
+		checkCreditBlocks(fifo, 3);
+	}
+	{
+		BufferFifo fifo(1024, 16);
+		fifo.setCreditLimit(0, 2500);
+		checkCreditBlocks(fifo, 2);
+	}
+}
+
+// pipeline: int64 records cross an in place buffer stage, a slow record stage and a sink.
+// EOF reaches the sink, the slow stage is the bottleneck and every fifo's credit is returned,
+// though one large record grows the first fifo's Buffers beyond the second's.
+// Fed by a broadcast, the buffer stage forwards copies of its read-only views
+static bool incrementStage(Buffer &buf, marked_ostream *os) {
+	for (char *c = buf.gbegin(); c + sizeof(int64_t) <= buf.gend(); c += sizeof(int64_t)) {
+		int64_t v;
+		memcpy(&v, c, sizeof(v));
+		v++;
+		memcpy(c, &v, sizeof(v));
+	}
+	return true;
+}
+static bool forwardStage(Buffer &buf, marked_ostream *os) {
+	return true;
+}
+static void doubleStage(marked_istream &is, marked_ostream *os, long wait_us) {
+	int64_t v;
+	is.read((char*) &v, sizeof(v));
+	v *= 2;
+	os->write((const char*) &v, sizeof(v));
+	os->setMark();
+	if (wait_us > 0)
+		boost::this_thread::sleep( boost::posix_time::microseconds(wait_us) );
+}
+static void sumStage(marked_istream &is, marked_ostream *os, boost::atomic<int64_t> *sum) {
+	int64_t v;
+	is.read((char*) &v, sizeof(v));
+	*sum += v;
+}
+void testPipeline() {
+	const int64_t records = 8000, large = 4096;
+	boost::atomic<int64_t> sum(0);
+	{
+		Pipeline pipeline(1024, 64);
+		pipeline.addBufferStage("increment", &incrementStage, 2);
+		pipeline.addRecordStage("double", boost::bind(&doubleStage, _1, _2, 20));
+		pipeline.addRecordStage("sum", boost::bind(&sumStage, _1, _2, &sum), 2, true);
+		pipeline.start();
+		{
+			marked_ostream os(pipeline.getInput());
+			for (int64_t i = 0; i < records; i++) {
+				os.write((const char*) &i, sizeof(i));
+				// records of 16, and one of large values
+				if (i % 16 == 15 && (i < 1024 || i >= 1024 + large))
+					os.setMark();
+			}
+		}
+		pipeline.getInput().setEOF();
+		pipeline.join();
+		// sum of 2 * (i + 1)
+		CHECK(sum.load() == records * (records + 1));
+		CHECK(pipeline.getStage(0).getItems() > 0 && pipeline.getStage(2).getItems() == records);
+		CHECK(pipeline.getBottleneck() == 1);
+		CHECK(pipeline.getFifo(0).getBufferSize() > pipeline.getFifo(1).getBufferSize());
+		for (int i = 0; i < pipeline.getFifoCount(); i++) {
+			CHECK(pipeline.getFifo(i).isEOF());
+			checkCreditReturned(pipeline.getFifo(i));
+		}
+	}
+
+	sum = 0;
+	{
+		BufferFifo source(1024, 64);
+		Pipeline pipeline(1024, 64);
+		source.subscribe(pipeline.getInput());
+		pipeline.addBufferStage("forward", &forwardStage, 2);
+		pipeline.addRecordStage("sum", boost::bind(&sumStage, _1, _2, &sum), 1, true);
+		pipeline.start();
+		{
+			marked_ostream os(source);
+			for (int64_t i = 0; i < records; i++) {
+				os.write((const char*) &i, sizeof(i));
+				os.setMark();
+			}
+		}
+		source.setEOF();
+		pipeline.join();
+		CHECK(sum.load() == records * (records - 1) / 2);
+		checkCreditReturned(source);
+		for (int i = 0; i < pipeline.getFifoCount(); i++)
+			checkCreditReturned(pipeline.getFifo(i));
+	}
+}
+
+// selector: streams on three fifos with separate writers.  select() wakes on a push, returns
+// only streams with data, and isEOF() holds only once every fifo is at EOF and every stream drained
+static void writeAfter(BufferFifo *fifo, int64_t value, long delay_ms) {
+	boost::this_thread::sleep(boost::posix_time::milliseconds(delay_ms));
+	marked_ostream os(*fifo);
+	os.write((const char*) &value, sizeof(value));
+	os.setMark(true);
+}
+static void writeThenEOF(BufferFifo *fifo, int64_t count, int64_t first) {
+	writeSequence(*fifo, count, first);
+	fifo->setEOF();
+}
+// reads the ready streams, counting in order records per stream.  false if one was not readable
+static bool drainReady(StreamSelector &selector, const vector< int > &ready, vector< int64_t > &next) {
+	bool readable = true;
+	for (size_t r = 0; r < ready.size(); r++) {
+		marked_istream &is = selector.getStream(ready[r]);
+		readable &= is.rdbuf()->in_avail() > 0;
+		int64_t v;
+		while (is.isReady()) {
+			is.read((char*) &v, sizeof(v));
+			if (v == next[ready[r]])
+				next[ready[r]]++;
+		}
+	}
+	return readable;
+}
+void testSelector() {
+	const int64_t records = 10000;
+	BufferFifo a(1024, 256), b(1024, 256), c(1024, 256);
+	marked_istream isA(a), isB(b), isC(c);
+	StreamSelector selector;
+	int idxA = selector.add(isA), idxB = selector.add(isB), idxC = selector.add(isC);
+	vector< int > ready;
+	vector< int64_t > next(3, 0);
+	CHECK(selector.select(ready, 0) == 0);
+
+	boost::thread pusher( boost::bind( writeAfter, &b, 0, 50 ) );
+	boost::system_time start = boost::get_system_time();
+	CHECK(selector.select(ready, 5000000) == 1 && ready[0] == idxB);
+	CHECK((boost::get_system_time() - start).total_milliseconds() < 4000);
+	CHECK(drainReady(selector, ready, next) && next[idxB] == 1);
+	pusher.join();
+
+	writeThenEOF(&a, records, 0);
+	CHECK(selector.select(ready, 0) == 1 && ready[0] == idxA);
+	CHECK(drainReady(selector, ready, next) && next[idxA] == records);
+	CHECK(!selector.isEOF());
+
+	boost::thread_group writers;
+	writers.create_thread( boost::bind( writeThenEOF, &b, records, 1 ) );
+	writers.create_thread( boost::bind( writeThenEOF, &c, records, 0 ) );
+	bool readable = true;
+	while (!selector.isEOF()) {
+		selector.select(ready, 1000);
+		readable &= drainReady(selector, ready, next);
+	}
+	writers.join_all();
+	CHECK(readable);
+	CHECK(next[idxA] == records && next[idxB] == records + 1 && next[idxC] == records);
+}
+
+// lanes: marked_ostreams on two lanes of one fifo.  The higher lane is drained first,
+// but while the lower lane waits it is served after every laneWeight pops from above
+void testLanes() {
+	const int weight = 4, bulk = 20, urgent = 200;
+	const int64_t urgentBase = 1000000;
+	BufferFifo fifo(64, 512, 2);
+	fifo.setLaneWeight(weight);
+	CHECK(fifo.getNumLanes() == 2);
+	{
+		marked_ostream low(fifo, 0), high(fifo, 1);
+		CHECK(high.rdbuf()->getLane() == 1);
+		for (int64_t i = 0; i < urgent; i++) {
+			int64_t v = urgentBase + i;
+			high.write((const char*) &v, sizeof(v));
+			high.setMark(true);
+		}
+		for (int64_t i = 0; i < bulk; i++) {
+			low.write((const char*) &i, sizeof(i));
+			low.setMark(true);
+		}
+	}
+	CHECK(fifo.getLaneQueueSize(0) == bulk && fifo.getLaneQueueSize(1) == urgent);
+	fifo.setEOF();
+
+	vector< int > bulkAt; // pop position of every bulk Buffer
+	int64_t nextBulk = 0, nextUrgent = urgentBase;
+	int pops = 0, run = 0, longestRun = 0;
+	BufferFifo::BufferPtr p = NULL;
+	while (fifo.pop(p, 1000)) {
+		int64_t v;
+		memcpy(&v, p->begin(), sizeof(v));
+		fifo.returnBuffer(p);
+		if (v >= urgentBase) {
+			CHECK(v == nextUrgent);
+			nextUrgent++;
+			if (nextBulk < bulk)
+				longestRun = std::max(longestRun, ++run);
+		} else {
+			CHECK(v == nextBulk);
+			nextBulk++;
+			bulkAt.push_back(pops);
+			run = 0;
+		}
+		pops++;
+	}
+	CHECK(pops == bulk + urgent && nextBulk == bulk);
+	CHECK(!bulkAt.empty() && bulkAt[0] == weight);
+	CHECK(longestRun == weight);
+	for (size_t k = 0; k < bulkAt.size(); k++)
+		CHECK(bulkAt[k] < (int) (k + 1) * (weight + 1));
+}
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+// coroutines: 200 reader coroutines on two executor threads await 100k records from two
+// writer threads (which overflowed the stack at -O0 while every await nested a coroutine frame),
+// others await whole Buffers, and more coroutines than the pool allows await Buffers from it
+static CoroutineTask<void> countRecords(marked_istream *is, int64_t *records, int64_t *sum) {
+	int64_t v;
+	while (co_await asyncNextRecord(*is)) {
+		is->read((char*) &v, sizeof(v));
+		(*records)++;
+		*sum += v;
+	}
+}
+static CoroutineTask<void> countBuffers(BufferFifo *fifo, int64_t *buffers) {
+	BufferFifo::BufferPtr p;
+	while ((p = co_await asyncPop(*fifo)) != NULL) {
+		fifo->returnBuffer(p);
+		(*buffers)++;
+	}
+}
+// suspends and reschedules, so other coroutines run while a Buffer is held
+struct YieldAwaiter {
+	bool await_ready() const { return false; }
+	void await_suspend(std::coroutine_handle<> h) { CoroutineExecutor::current()->schedule(h); }
+	void await_resume() {}
+};
+static CoroutineTask<void> holdBuffers(BufferPool *pool, int64_t maxOutstanding, int times, int *acquired) {
+	for (int i = 0; i < times; i++) {
+		BufferPool::BufferPtr p = co_await asyncAcquire(*pool, maxOutstanding);
+		(*acquired)++;
+		co_await YieldAwaiter();
+		pool->returnBuffer(p);
+	}
+}
+void testCoroutines() {
+	const int readers = 200, writers = 2;
+	const int64_t records = 100000;
+	{
+		BufferFifo fifo(1024, 256);
+		vector< marked_istream_ptr > is(readers);
+		vector< int64_t > counts(readers, 0), sums(readers, 0);
+		CoroutineExecutor executors[2];
+		for (int i = 0; i < readers; i++) {
+			is[i].reset( new marked_istream(fifo) );
+			executors[i % 2].spawn( countRecords(is[i].get(), &counts[i], &sums[i]) );
+		}
+		boost::thread_group group;
+		for (int e = 0; e < 2; e++)
+			group.create_thread( boost::bind( &CoroutineExecutor::run, &executors[e] ) );
+		boost::thread_group writerGroup;
+		for (int w = 0; w < writers; w++)
+			writerGroup.create_thread( boost::bind( &writeSequence, boost::ref(fifo), records / writers, w * (records / writers) ) );
+		writerGroup.join_all();
+		fifo.setEOF();
+		group.join_all();
+		int64_t count = 0, sum = 0;
+		for (int i = 0; i < readers; i++) {
+			count += counts[i];
+			sum += sums[i];
+		}
+		CHECK(count == records);
+		CHECK(sum == records * (records - 1) / 2);
+		is.clear();
+		CHECK(fifo.getCreditBuffers() == 0);
+	}
+	{
+		BufferFifo fifo(1024, 64);
+		vector< int64_t > buffers(10, 0);
+		CoroutineExecutor executor;
+		for (size_t i = 0; i < buffers.size(); i++)
+			executor.spawn( countBuffers(&fifo, &buffers[i]) );
+		boost::thread runner( boost::bind( &CoroutineExecutor::run, &executor ) );
+		writeSequence(fifo, records);
+		fifo.setEOF();
+		runner.join();
+		int64_t popped = 0;
+		for (size_t i = 0; i < buffers.size(); i++)
+			popped += buffers[i];
+		CHECK(fifo.isEOF() && fifo.getQueueSize() == 0);
+		CHECK((int64_t) (records * sizeof(int64_t) / 1024) <= popped);
+	}
+	{
+		BufferPool pool(4, 256);
+		vector< int > acquired(8, 0);
+		CoroutineExecutor executor;
+		for (size_t i = 0; i < acquired.size(); i++)
+			executor.spawn( holdBuffers(&pool, 3, 100, &acquired[i]) );
+		executor.run();
+		for (size_t i = 0; i < acquired.size(); i++)
+			CHECK(acquired[i] == 100);
+		CHECK(pool.getAllocCount() == 3);
+	}
+}
+#endif
+
+// broadcast: every subscriber gets the writer's records, in order, under its policy.  While no reader runs,
+// a BroadcastDrop subscriber misses some and a BroadcastSpill one spills to disk without blocking the writer,
+// and the source's credit is returned once all the views are released.  Swapping a view moves the view
+static void readIncreasing(BufferFifo *fifo, int64_t *count, bool *increasing) {
+	marked_istream is(*fifo);
+	int64_t last = -1, v;
+	while (is.isReady(1000)) {
+		while (is.isReady()) {
+			is.read((char*) &v, sizeof(v));
+			if (v <= last)
+				*increasing = false;
+			last = v;
+			(*count)++;
+		}
+	}
+}
+void testBroadcast() {
+	const int64_t records = 20000;
+	{
+		BufferFifo source(1024, 64), block(1024, 64), drop(1024, 64), spill(1024, 64);
+		source.subscribe(block);
+		source.subscribe(drop, BufferFifo::BroadcastDrop, 8);
+		source.subscribe(spill, BufferFifo::BroadcastSpill, 8);
+		CHECK(source.getSubscriberCount() == 3);
+		int64_t blockCount = 0;
+		bool blockIncreasing = true;
+		boost::thread blockReader( boost::bind( &readIncreasing, &block, &blockCount, &blockIncreasing ) );
+		writeSequence(source, records);
+		source.setEOF();
+		CHECK(spill.getSpilledBytes() > 0);
+		int64_t dropCount = 0, spillCount = 0;
+		bool dropIncreasing = true, spillIncreasing = true;
+		readIncreasing(&drop, &dropCount, &dropIncreasing);
+		readIncreasing(&spill, &spillCount, &spillIncreasing);
+		blockReader.join();
+		CHECK(blockCount == records && blockIncreasing);
+		CHECK(spillCount == records && spillIncreasing);
+		CHECK(dropCount < records && dropIncreasing && drop.getBroadcastDropped() > 0);
+		CHECK(block.isEOF() && drop.isEOF() && spill.isEOF());
+		checkCreditReturned(source);
+	}
+	{
+		Buffer src(64), other(64), v(0), w(0);
+		src.addRefs(2);
+		v.view(src);
+		v.swap(w);
+		CHECK(w.isView() && !v.isView());
+		CHECK(w.unview() == &src);
+		src.swap(other);
+		CHECK(other.releaseRef() == 1 && src.addRefs(0) == 0);
+	}
+}
+
+// indexed: records just under the bufferSize, in one or two writes, keep their bytes
+// although the record index trailer takes part of each Buffer, and skipRecords() lands on them
+static int32_t indexedLength(int64_t i) {
+	return 1000 + (int32_t) ((i * 7) % 24) - (int32_t) sizeof(int32_t);
+}
+static void writeIndexed(BufferFifo *fifo, int64_t records) {
+	marked_ostream os(*fifo);
+	vector< char > record;
+	for (int64_t i = 0; i < records; i++) {
+		int32_t len = indexedLength(i);
+		record.assign(sizeof(len) + len, (char) i);
+		memcpy(&record[0], &len, sizeof(len));
+		if (i % 4 != 3) {
+			os.write(&record[0], record.size());
+		} else {
+			os.write(&record[0], sizeof(len));
+			os.write(&record[sizeof(len)], len);
+		}
+		os.setMark();
+	}
+}
+void testIndexed() {
+	const int64_t records = 2000;
+	BufferFifo fifo(1024, 4096);
+	fifo.setRecordIndex(true);
+	// written up front, so a truncated record cannot leave the reader waiting
+	writeIndexed(&fifo, records);
+	fifo.setEOF();
+	int64_t read = 0, skipped = 0, corrupt = 0;
+	{
+		marked_istream is(fifo);
+		vector< char > body;
+		for (int64_t i = 0; i < records; i++) {
+			if (i % 10 == 5) {
+				skipped += is.skipRecords(1);
+				continue;
+			}
+			int32_t len = 0;
+			is.isReady(1000);
+			is.read((char*) &len, sizeof(len));
+			if (len != indexedLength(i)) {
+				corrupt++;
+				break;
+			}
+			body.assign(len, 0);
+			is.read(&body[0], len);
+			if (count(body.begin(), body.end(), (char) i) != len)
+				corrupt++;
+			read++;
+		}
+		CHECK(!is.isReady(1000));
+	}
+	CHECK(corrupt == 0);
+	CHECK(read + skipped == records && skipped == records / 10);
+	checkCreditReturned(fifo);
+}
+
+// shared: threads writing tagged records through one SharedBufferWriter, with slots rotating
+// quickly through small Buffers and every 500th record larger than a Buffer, get each record
+// to the reader exactly once and intact
+static int32_t sharedLength(int32_t seq) {
+	return seq % 500 == 7 ? 3000 : 12 + seq % 200;
+}
+static void writeShared(SharedBufferWriter *shared, int32_t writer, int32_t records) {
+	vector< char > record;
+	for (int32_t seq = 0; seq < records; seq++) {
+		int32_t len = sharedLength(seq);
+		record.assign(len, (char) (writer * 31 + seq));
+		memcpy(&record[0], &len, sizeof(len));
+		memcpy(&record[4], &writer, sizeof(writer));
+		memcpy(&record[8], &seq, sizeof(seq));
+		shared->write(&record[0], len);
+	}
+}
+// the writer flushes and deregisters when deleted, before the fifo's EOF
+static void closeAfter(boost::thread_group *writers, SharedBufferWriter *shared, int64_t *written) {
+	writers->join_all();
+	*written = shared->getRecords();
+	BufferFifo &fifo = shared->getBufferFifo();
+	delete shared;
+	fifo.setEOF();
+}
+void testShared() {
+	const int writers = 4;
+	const int32_t records = 20000;
+	BufferFifo fifo(1024, 64);
+	vector< vector< int > > seen(writers, vector< int >(records, 0));
+	int64_t corrupt = 0, written = 0;
+	{
+		SharedBufferWriter *shared = new SharedBufferWriter(fifo);
+		boost::thread_group threads;
+		for (int w = 0; w < writers; w++)
+			threads.create_thread( boost::bind( writeShared, shared, w, records ) );
+		boost::thread closer( boost::bind( closeAfter, &threads, shared, &written ) );
+		BufferFifo::BufferPtr p = NULL;
+		while (fifo.pop(p, 1000) || !fifo.isEOF()) {
+			if (p == NULL)
+				continue;
+			const char *c = p->begin();
+			Buffer::Size offset = 0;
+			while (offset < p->size()) {
+				int32_t len, writer, seq;
+				memcpy(&len, c + offset, sizeof(len));
+				memcpy(&writer, c + offset + 4, sizeof(writer));
+				memcpy(&seq, c + offset + 8, sizeof(seq));
+				if (len < 12 || offset + len > p->size() || writer < 0 || writer >= writers || seq < 0 || seq >= records
+						|| len != sharedLength(seq)) {
+					corrupt++;
+					break;
+				}
+				char fill = (char) (writer * 31 + seq);
+				if (count(c + offset + 12, c + offset + len, fill) != len - 12)
+					corrupt++;
+				seen[writer][seq]++;
+				offset += len;
+			}
+			fifo.returnBuffer(p);
+			p = NULL;
+		}
+		closer.join();
+	}
+	CHECK(written == writers * (int64_t) records);
+	int64_t once = 0;
+	for (int w = 0; w < writers; w++)
+		once += count(seen[w].begin(), seen[w].end(), 1);
+	CHECK(corrupt == 0);
+	CHECK(once == writers * (int64_t) records);
+	checkCreditReturned(fifo);
+}
+
+// lazy: streams take a pool Buffer only to write or read one.  A reader polling an empty fifo
+// or one it has drained holds none, and an idle writer pushes and releases its partial Buffer
+void testLazy() {
+	BufferFifo fifo(1024, 16);
+	marked_istream is(fifo);
+	is.rdbuf()->setReadWait(0); // pop() waits for a Buffer or EOF otherwise
+	CHECK(!is.isReady());
+	CHECK(!is.rdbuf()->hasBuffer() && fifo.getCreditBuffers() == 0);
+	{
+		marked_ostream os(fifo);
+		CHECK(!os.rdbuf()->hasBuffer() && fifo.getCreditBuffers() == 0);
+		os.setIdleTimeout(10000);
+		int64_t v = 7;
+		os.write((const char*) &v, sizeof(v));
+		os.setMark();
+		CHECK(os.rdbuf()->hasBuffer() && fifo.getCreditBuffers() == 1);
+		CHECK(!os.releaseIfIdle());
+		boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+		CHECK(os.releaseIfIdle());
+		CHECK(!os.rdbuf()->hasBuffer() && fifo.getQueueSize() == 1);
+	}
+	int64_t v = 0;
+	CHECK(is.isReady(1000));
+	is.read((char*) &v, sizeof(v));
+	CHECK(v == 7);
+	CHECK(!is.isReady());
+	CHECK(!is.rdbuf()->hasBuffer());
+	checkCreditReturned(fifo);
+	fifo.setEOF();
+}
+
+// maxdelay: a partial Buffer stays with a quiet writer until flushIfDue() finds its oldest record
+// has waited the max delay, and then reaches the reader
+void testMaxDelay() {
+	BufferFifo fifo(1024, 16);
+	fifo.setMaxDelay(20000);
+	{
+		marked_ostream os(fifo);
+		int64_t v = 11;
+		os.write((const char*) &v, sizeof(v));
+		os.setMark();
+		CHECK(!os.flushIfDue() && fifo.getQueueSize() == 0);
+		boost::this_thread::sleep(boost::posix_time::milliseconds(30));
+		CHECK(os.flushIfDue() && fifo.getQueueSize() == 1 && fifo.getDelayedFlushes() == 1);
+		CHECK(!os.flushIfDue());
+	}
+	fifo.setEOF();
+	CHECK(readSequence(fifo, 11) == 1);
+	checkCreditReturned(fifo);
+}
+
+// tuner: a window of mostly small pushes into 2KB Buffers shrinks the recommended buffer size to
+// 8 mean records and halves the mostly idle pool, a window of full Buffers of large records doubles both
+void testTuner() {
+	BufferTuner tuner;
+	tuner.setBounds(256, 65536, 4, 1024);
+	Buffer::Size size = 2048;
+	long pool = 64;
+	bool due = false;
+	for (int i = 0; i < BufferTuner::Window; i++) {
+		CHECK(!due);
+		// 231 pushes of 100 bytes, 25 of 1000: a mean of 187, the 90th percentile under 128
+		due = tuner.sample(i % 10 == 9 ? 1000 : 100, size, 1, 0, 2);
+	}
+	CHECK(due);
+	CHECK(tuner.decide(size, pool, 0, 0));
+	CHECK(size == 1536 && pool == 32);
+
+	for (int i = 0; i < BufferTuner::Window; i++)
+		due = tuner.sample(1500, size, 4, 8, 30);
+	CHECK(due);
+	CHECK(tuner.decide(size, pool, 0, 0));
+	CHECK(size == 3072 && pool == 64);
+}
+
+// capture: two streams' record sizes, flushes and timing, over several interleaved chunks,
+// load back from the trace as they were written
+static int32_t capturedLength(int stream, int i) {
+	return stream == 0 ? 8 + i % 50 : 100;
+}
+void testCapture() {
+	const int records = 1200;
+	stringstream path;
+	path << "/tmp/unit_test.trace." << getpid();
+	{
+		TrafficCapture capture(path.str());
+		BufferFifo fifo(1024, 4096); // unread, so room for every flush
+		{
+			marked_ostream os0(fifo), os1(fifo);
+			os0.setCapture(&capture, 3);
+			os1.setCapture(&capture, 5);
+			vector< char > record(128, 'c');
+			for (int i = 0; i < records; i++) {
+				if (i == records / 2)
+					boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+				os0.write(&record[0], capturedLength(0, i));
+				os0.setMark(i % 10 == 9);
+				os1.write(&record[0], capturedLength(1, i));
+				os1.setMark(i % 7 == 0);
+			}
+			// the recorders append their last chunks
+			os0.setCapture(NULL, 0);
+			os1.setCapture(NULL, 0);
+		}
+		capture.flush();
+		fifo.setEOF();
+	}
+	TrafficTrace trace;
+	CHECK(trace.load(path.str()));
+	unlink(path.str().c_str());
+	CHECK(trace.getStreamCount() == 2 && trace.getRecordCount() == 2 * records);
+	for (int s = 0; s < trace.getStreamCount() && s < 2; s++) {
+		int stream = trace.getStreamId(s) == 3 ? 0 : 1;
+		CHECK(trace.getStreamId(s) == (stream == 0 ? 3 : 5));
+		const TrafficTrace::Records &r = trace.getRecords(s);
+		CHECK((int) r.size() == records);
+		int sizes = 0, flushes = 0, ordered = 0;
+		for (int i = 0; i < (int) r.size() && i < records; i++) {
+			sizes += r[i].bytes == capturedLength(stream, i);
+			flushes += r[i].flush == (stream == 0 ? i % 10 == 9 : i % 7 == 0);
+			ordered += i == 0 || r[i].time_us >= r[i-1].time_us;
+		}
+		CHECK(sizes == records && flushes == records && ordered == records);
+		CHECK(r.size() > records / 2 && r[records / 2].time_us - r[records / 2 - 1].time_us >= 20000);
+	}
+}
+
+// readahead: a reader looping until isEOF() gets every record, though the fifo reaches EOF
+// while Buffers are still held in its read-ahead
+void testReadAhead() {
+	const int64_t records = 20000;
+	BufferFifo fifo(1024, 4096);
+	writeSequence(fifo, records);
+	fifo.setEOF();
+	int64_t next = 0, v;
+	{
+		marked_istream is(fifo);
+		is.setReadAhead(marked_fifo_streambuf::MaxReadAhead);
+		// one record per check, so isEOF() is asked mid Buffer too
+		while (!is.isEOF()) {
+			if (is.isReady()) {
+				is.read((char*) &v, sizeof(v));
+				if (v == next)
+					next++;
+			}
+		}
+		CHECK(is.rdbuf()->getReadAhead() == marked_fifo_streambuf::MaxReadAhead);
+	}
+	CHECK(next == records);
+	checkCreditReturned(fifo);
+}
+
+// spill: with no reader running, a small fifo spills to disk without blocking the writer, and the
+// reader gets every record in order.  A spill write cut short by the file size limit leaves no partial
+// Buffer behind to misframe the later ones.  A truncated spill file fails the fifo, but EOF is still reached
+static int findSpillFd() {
+	int found = -1;
+	for (int fd = 0; fd < 1024; fd++) {
+		char link[64], target[256];
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+		ssize_t n = readlink(link, target, sizeof(target) - 1);
+		if (n > 0) {
+			target[n] = '\0';
+			if (strstr(target, "BufferFifo.spill.") != NULL)
+				found = fd;
+		}
+	}
+	return found;
+}
+void testSpill() {
+	const int64_t records = 20000;
+	{
+		BufferFifo fifo(1024, 16);
+		CHECK(fifo.setSpill(4 * 1024));
+		writeSequence(fifo, records);
+		fifo.setEOF();
+		CHECK(fifo.getSpilledBytes() > 0 && fifo.getSpillPending() > 0);
+		CHECK(readSequence(fifo) == records);
+		CHECK(fifo.isEOF() && fifo.isOk() && fifo.getSpillPending() == 0);
+		checkCreditReturned(fifo);
+	}
+	{
+		BufferFifo fifo(1024, 64);
+		CHECK(fifo.setSpill(4 * 1024));
+		// 8 spilled Buffers of 12 + 1024 bytes fit, the 9th's header but not its payload
+		struct rlimit unlimited, limited;
+		CHECK(getrlimit(RLIMIT_FSIZE, &unlimited) == 0);
+		limited = unlimited;
+		limited.rlim_cur = 8 * (3 * sizeof(Buffer::Size) + 1024) + 3 * sizeof(Buffer::Size) + 100;
+		void (*handler)(int) = signal(SIGXFSZ, SIG_IGN);
+		CHECK(setrlimit(RLIMIT_FSIZE, &limited) == 0);
+		writeSequence(fifo, 2000);
+		CHECK(setrlimit(RLIMIT_FSIZE, &unlimited) == 0);
+		signal(SIGXFSZ, handler);
+		writeSequence(fifo, 2000, 2000);
+		fifo.setEOF();
+		// the Buffers queued in memory while the spill file was full overtake the spilled ones
+		vector< int64_t > got;
+		{
+			marked_istream is(fifo);
+			int64_t v;
+			while (is.isReady(1000)) {
+				while (is.isReady()) {
+					is.read((char*) &v, sizeof(v));
+					got.push_back(v);
+				}
+			}
+		}
+		sort(got.begin(), got.end());
+		bool once = got.size() == 4000;
+		for (size_t i = 0; once && i < got.size(); i++)
+			once = got[i] == (int64_t) i;
+		CHECK(once);
+		CHECK(fifo.isOk() && fifo.getSpillPending() == 0);
+		checkCreditReturned(fifo);
+	}
+	{
+		BufferFifo fifo(1024, 16);
+		CHECK(fifo.setSpill(4 * 1024));
+		writeSequence(fifo, records);
+		fifo.setEOF();
+		int fd = findSpillFd();
+		CHECK(fd >= 0);
+		struct stat st;
+		CHECK(fstat(fd, &st) == 0 && st.st_size > 0);
+		CHECK(ftruncate(fd, st.st_size / 2) == 0);
+		int64_t inOrder = readSequence(fifo);
+		CHECK(inOrder > 0 && inOrder < records);
+		CHECK(fifo.isEOF() && !fifo.isOk() && fifo.getSpillPending() == 0);
+		checkCreditReturned(fifo);
+	}
+}
+
+// codec: every header size decodes to what was encoded, both from its exact bytes (the scalar path)
+// and with more than 17 bytes remaining (the SSSE3 path, when built with it), and records
+// round trip through a fifo with readRecord() and with decodeBuffer()
+static int32_t codecId(int64_t i) {
+	return (int32_t) ((i % 7 == 0 ? -1 : 1) * (i * 2654435761LL % 100000));
+}
+static uint32_t codecBytes(int64_t i) {
+	return (uint32_t) (i % 13 == 0 ? 300 + i % 1000 : i % 40);
+}
+void testCodec() {
+	const uint32_t lengths[] = { 0, 1, 255, 256, 65535, 65536, (1u << 24) - 1, 1u << 24, 0xffffffffu };
+	const int32_t ids[] = { 0, 1, -1, 127, -128, 32767, -32768, 0x7fffffff, (int32_t) 0x80000000 };
+	int mismatches = 0;
+	for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+			char buf[32];
+			memset(buf, 0x5a, sizeof(buf));
+			int header = RecordCodec::encodeHeader(buf, lengths[l], ids[i]);
+			uint32_t bytes;
+			int32_t id;
+			if (header != RecordCodec::headerBytes(lengths[l], ids[i]))
+				mismatches++;
+			if (RecordCodec::decodeHeader(buf, buf + header, bytes, id) != header || bytes != lengths[l] || id != ids[i])
+				mismatches++;
+			if (RecordCodec::decodeHeader(buf, buf + sizeof(buf), bytes, id) != header || bytes != lengths[l] || id != ids[i])
+				mismatches++;
+			if (RecordCodec::decodeHeader(buf, buf + header - 1, bytes, id) != 0)
+				mismatches++;
+		}
+	}
+	CHECK(mismatches == 0);
+
+	const int64_t records = 5000;
+	vector< char > data(2000);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (char) i;
+	for (int pass = 0; pass < 2; pass++) {
+		BufferFifo fifo(1024, 1024);
+		{
+			marked_ostream os(fifo);
+			for (int64_t i = 0; i < records; i++)
+				RecordCodec::writeRecord(os, codecId(i), &data[i % 100], codecBytes(i));
+		}
+		fifo.setEOF();
+		int64_t matched = 0;
+		if (pass == 0) {
+			marked_istream is(fifo);
+			int32_t id;
+			vector< char > record;
+			for (int64_t i = 0; i < records && RecordCodec::readRecord(is, id, record); i++)
+				matched += id == codecId(i) && record.size() == codecBytes(i) && (record.empty() || memcmp(&record[0], &data[i % 100], record.size()) == 0);
+			CHECK(!RecordCodec::readRecord(is, id, record));
+		} else {
+			vector< RecordCodec::Record > decoded;
+			BufferFifo::BufferPtr p = NULL;
+			int64_t i = 0;
+			bool whole = true;
+			while (fifo.pop(p)) {
+				decoded.clear();
+				RecordCodec::decodeBuffer(*p, decoded);
+				whole = whole && p->gremainder() == 0;
+				// the records point into p, check them before it is returned
+				for (size_t r = 0; r < decoded.size(); r++, i++)
+					matched += decoded[r].id == codecId(i) && decoded[r].bytes == codecBytes(i) && memcmp(decoded[r].data, &data[i % 100], decoded[r].bytes) == 0;
+				fifo.returnBuffer(p);
+			}
+			CHECK(whole && i == records);
+		}
+		CHECK(matched == records);
+	}
+}
+
+// text: lines written in text mode in chunks that split them anywhere, with a last line
+// without a newline, come back whole and in order from readLines(), over many small Buffers
+void testText() {
+	const int lines = 20000;
+	string text;
+	vector< string > expected;
+	for (int i = 0; i < lines; i++) {
+		stringstream line;
+		line << "line " << i << " " << string(i % 50, 'x');
+		expected.push_back(line.str());
+		text += line.str();
+		if (i < lines - 1)
+			text += '\n';
+	}
+	BufferFifo fifo(256, 4096);
+	{
+		marked_ostream os(fifo);
+		os.setTextMode(true);
+		for (size_t pos = 0, chunk = 1; pos < text.size(); pos += chunk, chunk = chunk % 97 + 1)
+			os.write(text.data() + pos, std::min(chunk, text.size() - pos));
+	}
+	fifo.setEOF();
+	int matched = 0, read = 0;
+	{
+		marked_istream is(fifo);
+		vector< TextLines::Line > found;
+		while (is.readLines(found) > 0) {
+			for (size_t i = 0; i < found.size(); i++, read++)
+				matched += read < lines && found[i].str() == expected[read];
+			found.clear();
+		}
+	}
+	CHECK(read == lines && matched == lines);
+	checkCreditReturned(fifo);
+
+	const char sample[] = "a\nbc\n\nd";
+	CHECK(TextLines::findLastNewline(sample, sample + 7) == sample + 5);
+	CHECK(TextLines::findLastNewline(sample, sample + 1) == NULL);
+	CHECK(TextLines::findLastNewline(sample, sample + 2) == sample + 1);
+}
+
+// sort: a tiny memory budget and fanIn 2 force many runs and several intermediate merge passes,
+// and the output has every record in order.  With run files capped by the file size limit the merge
+// cannot write its larger runs, and the sort reports it instead of silently dropping records
+static bool int64Less(const char *a, Buffer::Size aLen, const char *b, Buffer::Size bLen) {
+	int64_t x, y;
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+	return x < y;
+}
+static void sortRecords(int64_t records, int64_t *count, bool *sorted, bool *ok, int *passes) {
+	ExternalSort sorter(int64Less, 4096, 2, 2, 1024, 64);
+	sorter.start();
+	{
+		marked_ostream os(sorter.getInput());
+		for (int64_t i = 0; i < records; i++) {
+			int64_t key = i * 2654435761LL % 10007;
+			os.write((const char*) &key, sizeof(key));
+			os.setMark();
+		}
+	}
+	sorter.getInput().setEOF();
+	*count = 0;
+	*sorted = true;
+	{
+		marked_istream is(sorter.getOutput());
+		int64_t last = -1, key;
+		while (is.isReady(1000)) {
+			while (is.isReady()) {
+				is.read((char*) &key, sizeof(key));
+				*sorted &= key >= last;
+				last = key;
+				(*count)++;
+			}
+		}
+	}
+	sorter.join();
+	*ok = sorter.isOk();
+	*passes = sorter.getMergePasses();
+}
+void testSort() {
+	const int64_t records = 20000;
+	int64_t count;
+	bool sorted, ok;
+	int passes;
+	sortRecords(records, &count, &sorted, &ok, &passes);
+	CHECK(count == records && sorted && ok);
+	CHECK(passes > 2);
+
+	struct rlimit unlimited, limited;
+	CHECK(getrlimit(RLIMIT_FSIZE, &unlimited) == 0);
+	limited = unlimited;
+	limited.rlim_cur = 32 * 1024;
+	void (*handler)(int) = signal(SIGXFSZ, SIG_IGN);
+	CHECK(setrlimit(RLIMIT_FSIZE, &limited) == 0);
+	sortRecords(records, &count, &sorted, &ok, &passes);
+	CHECK(setrlimit(RLIMIT_FSIZE, &unlimited) == 0);
+	signal(SIGXFSZ, handler);
+	CHECK(count < records && !ok);
+}
+
+// combiner: 2M exponentially skewed keys from two writers are combined before they are written,
+// so few records cross the fifo, and the reader's sums per key match what was added
+typedef KeyValueCombiner< int64_t, int64_t > SumCombiner;
+static void addSkewed(BufferFifo *fifo, int seed, int64_t adds, map< int64_t, int64_t > *sums, int64_t *emitted) {
+	boost::random::mt19937 rng(seed);
+	boost::random::exponential_distribution<> skew(1.0 / 100);
+	marked_ostream os(*fifo);
+	SumCombiner combiner(os, 4096);
+	for (int64_t i = 0; i < adds; i++) {
+		int64_t key = (int64_t) skew(rng), value = i % 7 + 1;
+		combiner.add(key, value);
+		(*sums)[key] += value;
+	}
+	combiner.flush();
+	*emitted = combiner.getEmitted();
+}
+static void setEOFAfter(boost::thread_group *writers, BufferFifo *fifo) {
+	writers->join_all();
+	fifo->setEOF();
+}
+void testCombiner() {
+	const int64_t adds = 1000000;
+	BufferFifo fifo(8192, 256);
+	map< int64_t, int64_t > sums[2];
+	int64_t emitted[2] = { 0, 0 };
+	boost::thread_group writers;
+	for (int w = 0; w < 2; w++)
+		writers.create_thread( boost::bind( &addSkewed, &fifo, w + 1, adds, &sums[w], &emitted[w] ) );
+	boost::thread eof( boost::bind( &setEOFAfter, &writers, &fifo ) );
+	map< int64_t, int64_t > read;
+	int64_t records = 0;
+	{
+		marked_istream is(fifo);
+		int64_t key, value;
+		while (SumCombiner::read(is, key, value)) {
+			read[key] += value;
+			records++;
+		}
+	}
+	eof.join();
+	for (map< int64_t, int64_t >::const_iterator it = sums[1].begin(); it != sums[1].end(); it++)
+		sums[0][it->first] += it->second;
+	CHECK(read == sums[0]);
+	CHECK(records == emitted[0] + emitted[1]);
+	CHECK(records * 100 < 2 * adds);
+	checkCreditReturned(fifo);
+}
+
+struct UnitTest {
+	const char *name;
+	void (*run)();
+};
+static const UnitTest tests[] = {
+	{ "socket", testSocket },
+	{ "credit", testCredit },
+	{ "pipeline", testPipeline },
+	{ "selector", testSelector },
+	{ "lanes", testLanes },
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+	{ "coroutines", testCoroutines },
+#endif
+	{ "broadcast", testBroadcast },
+	{ "indexed", testIndexed },
+	{ "shared", testShared },
+	{ "lazy", testLazy },
+	{ "maxdelay", testMaxDelay },
+	{ "tuner", testTuner },
+	{ "capture", testCapture },
+	{ "readahead", testReadAhead },
+	{ "spill", testSpill },
+	{ "codec", testCodec },
+	{ "text", testText },
+	{ "sort", testSort },
+	{ "combiner", testCombiner },
+};
+
+int main(int argc, char *argv[]) {
+	int ran = 0;
+	for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		if (argc > 1 && find(argv + 1, argv + argc, string(tests[t].name)) == argv + argc)
+			continue;
+		int before = failures;
+		boost::system_time start = boost::get_system_time();
+		tests[t].run();
+		LOG(tests[t].name << ": " << (failures == before ? "ok " : "FAILED ") << (boost::get_system_time() - start).total_milliseconds() << "ms");
+		ran++;
+	}
+	LOG(ran << " tests, " << failures << " failed checks");
+	return failures == 0 ? 0 : 1;
+}